@@ -0,0 +1,188 @@
+#include "ChainInfer.h"
+#include "plugin_loader.h"
+#include "plugin_options.h"
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+PrePost* createChain(const char* model_path, const std::vector<size_t>& out_sizes) {
+    return new ChainInfer(model_path, out_sizes);
+}
+
+PrePost* createChainFrom(const std::vector<PrePost*>& models) {
+    return new ChainInfer(models);
+}
+
+ChainInfer::ChainInfer(const char* model_path, const std::vector<size_t>& out_sizes){
+    std::stringstream ss(model_path);
+    std::string path;
+    while(std::getline(ss, path, ';'))
+        if(!path.empty())
+            model_paths.push_back(path);
+    for(size_t k = 0; k < model_paths.size(); ++k){
+        bool last = (k + 1 == model_paths.size());
+        stages.emplace_back(new stage());
+        stages.back()->model.reset(create_plugin(model_paths[k], last ? out_sizes : std::vector<size_t>()));
+    }
+    init();
+}
+
+ChainInfer::ChainInfer(const std::vector<PrePost*>& models){
+    for(PrePost* model : models){
+        stages.emplace_back(new stage());
+        stages.back()->model.reset(model);
+    }
+    init();
+}
+
+// Intermediate FeatureMaps are plain float buffers like the ones MxAccl hands out
+static MX::Types::FeatureMap<float>* make_featuremap(size_t count){
+    return new MX::Types::FeatureMap<float>(count);
+}
+
+void ChainInfer::init(){
+    if(stages.empty())
+        throw std::runtime_error("ChainInfer: no models to chain");
+    for(size_t k = 1; k < stages.size(); ++k)
+        link(k);
+    dynamic_output = stages.back()->model->dynamic_output;
+
+    long depth = std::max(1L, plugin_option_int("MX_PLUGIN_CHAIN_DEPTH", 1));
+    for(long d = 0; d < depth; ++d){
+        slot* s = new slot();
+        slots.emplace_back(s);
+        s->outputs.resize(stages.size() - 1);
+        s->inputs.resize(stages.size() - 1);
+        for(size_t k = 0; k + 1 < stages.size(); ++k){
+            for(size_t size : stages[k]->model->get_output_sizes()){
+                s->buffers.emplace_back(make_featuremap(size));
+                s->outputs[k].push_back(s->buffers.back().get());
+            }
+            for(size_t source : stages[k + 1]->sources)
+                s->inputs[k].push_back(s->outputs[k][source]);
+        }
+        free_slots.push_back(s);
+    }
+}
+
+void ChainInfer::link(size_t k){
+    PrePost* prev = stages[k - 1]->model.get();
+    PrePost* next = stages[k]->model.get();
+    std::vector<std::string> out_names = prev->get_output_names();
+    std::vector<std::vector<int64_t>> out_shapes = prev->get_output_shapes();
+    std::vector<size_t> out_sizes = prev->get_output_sizes();
+    std::vector<std::string> in_names = next->get_input_names();
+    std::vector<std::vector<int64_t>> in_shapes = next->get_input_shapes();
+    std::vector<size_t> in_sizes = next->get_input_sizes();
+
+    // Intermediate FeatureMaps are allocated once at their fixed size
+    if(prev->dynamic_output){
+        std::ostringstream oss;
+        oss << "ChainInfer: stage " << k - 1 << " has dynamic outputs, only the last stage may";
+        throw std::runtime_error(oss.str());
+    }
+
+    std::vector<bool> used(out_sizes.size(), false);
+    std::vector<size_t>& sources = stages[k]->sources;
+    for(size_t i = 0; i < in_sizes.size(); ++i){
+        size_t source = out_sizes.size();
+        for(size_t j = 0; j < out_names.size() && source == out_sizes.size(); ++j)
+            if(i < in_names.size() && out_names[j] == in_names[i])
+                source = j;
+        for(size_t j = 0; j < out_shapes.size() && source == out_sizes.size(); ++j)
+            if(!used[j] && i < in_shapes.size() && out_shapes[j] == in_shapes[i])
+                source = j;
+        if(source == out_sizes.size() && i < out_sizes.size() && !used[i])
+            source = i;
+        if(source == out_sizes.size()){
+            std::ostringstream oss;
+            oss << "ChainInfer: nothing from stage " << k - 1 << " matches input " << i << " of stage " << k;
+            throw std::runtime_error(oss.str());
+        }
+        if(out_sizes[source] == 0 || in_sizes[i] == 0){
+            std::ostringstream oss;
+            oss << "ChainInfer: output " << source << " of stage " << k - 1 << " or input " << i << " of stage " << k
+                << " has a dynamic size, stages can only be linked through fixed-size tensors";
+            throw std::runtime_error(oss.str());
+        }
+        if(out_sizes[source] < in_sizes[i]){
+            std::ostringstream oss;
+            oss << "ChainInfer: output " << source << " of stage " << k - 1 << " holds " << out_sizes[source]
+                << " values, input " << i << " of stage " << k << " needs " << in_sizes[i];
+            throw std::runtime_error(oss.str());
+        }
+        used[source] = true;
+        sources.push_back(source);
+    }
+}
+
+ChainInfer::slot* ChainInfer::acquire(){
+    std::unique_lock<std::mutex> lock(slots_mutex);
+    slot_free.wait(lock, [this](){ return !free_slots.empty(); });
+    slot* s = free_slots.back();
+    free_slots.pop_back();
+    return s;
+}
+
+void ChainInfer::release(slot* s){
+    {
+        std::lock_guard<std::mutex> lock(slots_mutex);
+        free_slots.push_back(s);
+    }
+    slot_free.notify_one();
+}
+
+void ChainInfer::runinference(std::vector<MX::Types::FeatureMap<float>*> input, std::vector<MX::Types::FeatureMap<float>*> output){
+    slot* s = acquire();
+    try{
+        size_t last = stages.size() - 1;
+        for(size_t k = 0; k <= last; ++k){
+            std::lock_guard<std::mutex> lock(stages[k]->mutex);
+            stages[k]->model->runinference(k == 0 ? input : s->inputs[k - 1], k == last ? output : s->outputs[k]);
+        }
+    }
+    catch(...){
+        release(s);
+        throw;
+    }
+    release(s);
+}
+
+std::vector<std::vector<int64_t>> ChainInfer::get_input_shapes(){
+    return stages.front()->model->get_input_shapes();
+}
+
+std::vector<std::vector<int64_t>> ChainInfer::get_output_shapes(){
+    return stages.back()->model->get_output_shapes();
+}
+
+std::vector<size_t> ChainInfer::get_output_sizes(){
+    return stages.back()->model->get_output_sizes();
+}
+
+std::vector<size_t> ChainInfer::get_input_sizes(){
+    return stages.front()->model->get_input_sizes();
+}
+
+std::vector<std::string> ChainInfer::get_output_names(){
+    return stages.back()->model->get_output_names();
+}
+
+std::vector<std::string> ChainInfer::get_input_names(){
+    return stages.front()->model->get_input_names();
+}
+
+size_t ChainInfer::num_stages(){
+    return stages.size();
+}
+
+PrePost* ChainInfer::get_stage(size_t k){
+    return stages[k]->model.get();
+}
+
+ChainInfer::~ChainInfer(){
+    // Stages go before the FeatureMaps bound to them
+    stages.clear();
+    slots.clear();
+}
@@ -0,0 +1,67 @@
+#ifndef CHAIN_INFER
+#define CHAIN_INFER
+
+#include <memx/accl/prepost.h>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Runs several pre/post models back to back as one plugin. The inputs of each
+// stage are the outputs of the previous one, matched by name, then by shape,
+// then by position, and handed over as the same FeatureMaps: intermediate
+// tensors are allocated once and never copied between stages, so all outputs
+// but those of the last stage must have a fixed size.
+// Calls in flight at the same time move through the stages like a pipeline,
+// each stage runs one call at a time.
+//   MX_PLUGIN_CHAIN_DEPTH  calls in flight at once (default 1)
+class ChainInfer : public PrePost{
+    private:
+        struct stage{
+            std::unique_ptr<PrePost> model;
+            std::vector<size_t> sources; // output of the previous stage feeding each input
+            std::mutex mutex;
+        };
+        // Intermediate FeatureMaps of one call in flight
+        struct slot{
+            std::vector<std::unique_ptr<MX::Types::FeatureMap<float>>> buffers;
+            std::vector<std::vector<MX::Types::FeatureMap<float>*>> inputs;  // of stages 1..n-1
+            std::vector<std::vector<MX::Types::FeatureMap<float>*>> outputs; // of stages 0..n-2
+        };
+        std::deque<std::string> model_paths;
+        std::vector<std::unique_ptr<stage>> stages;
+        std::vector<std::unique_ptr<slot>> slots;
+        std::vector<slot*> free_slots;
+        std::mutex slots_mutex;
+        std::condition_variable slot_free;
+
+        void init();
+        void link(size_t k);
+        slot* acquire();
+        void release(slot* s);
+    public:
+        ChainInfer(const char* model_paths, const std::vector<size_t>& out_sizes);
+        ChainInfer(const std::vector<PrePost*>& models);
+        ~ChainInfer();
+        void runinference(std::vector<MX::Types::FeatureMap<float>*> input, std::vector<MX::Types::FeatureMap<float>*> output) override;
+        std::vector<std::vector<int64_t>> get_input_shapes() override;
+        std::vector<std::vector<int64_t>> get_output_shapes() override;
+        std::vector<size_t> get_output_sizes() override;
+        std::vector<size_t> get_input_sizes() override;
+        std::vector<std::string> get_output_names() override;
+        std::vector<std::string> get_input_names() override;
+        size_t num_stages();
+        PrePost* get_stage(size_t k);
+};
+
+// createChain takes the models separated by ';', e.g. "decode.onnx;classify.tflite",
+// and loads each with the plugin for its extension; out_sizes apply to the last model.
+// createChainFrom chains plugins that were already created and takes ownership of them.
+extern "C" {
+    PrePost* createChain(const char* model_path, const std::vector<size_t>& out_sizes);
+    PrePost* createChainFrom(const std::vector<PrePost*>& models);
+}
+
+#endif
@@ -0,0 +1,254 @@
+#ifndef ASYNC_PREPOST
+#define ASYNC_PREPOST
+
+#include <memx/accl/prepost.h>
+#include "plugin_options.h"
+#include "plugin_warmup.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Threads constructing the models of the createXxxBatch factories, so models
+// parse, optimize and warm up concurrently instead of one after the other.
+//   MX_PLUGIN_LOADER_THREADS  size of the pool (default: number of cores)
+class loader_pool{
+    public:
+        static loader_pool& instance(){
+            // Never destroyed: retired models may still be handed over from static destructors
+            static loader_pool* pool = new loader_pool();
+            return *pool;
+        }
+
+        void post(std::function<void()> task){
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                tasks.push_back(std::move(task));
+            }
+            cv.notify_one();
+        }
+
+    private:
+        loader_pool(){
+            long num_threads = plugin_option_int("MX_PLUGIN_LOADER_THREADS", (long)std::thread::hardware_concurrency());
+            num_threads = std::max(1L, num_threads);
+            for(long i = 0; i < num_threads; ++i)
+                std::thread(&loader_pool::worker, this).detach();
+        }
+
+        void worker(){
+            while(true){
+                std::function<void()> task;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    cv.wait(lock, [this](){ return !tasks.empty(); });
+                    task = std::move(tasks.front());
+                    tasks.pop_front();
+                }
+                task();
+            }
+        }
+
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<std::function<void()>> tasks;
+};
+
+// PrePost handle returned by the createXxxBatch factories. The model is built on
+// the loader pool; the factories hand the handles out once their models are
+// ready, so dynamic_output is final by then.
+//
+// reload() builds a replacement the same way, warms it up and checks that its
+// input and output shapes match the live model before swapping it in. Every
+// call runs start to end on the model it started with, so in-flight calls
+// finish on the old one, which is destroyed on the loader pool once the last
+// of them is done.
+class async_prepost : public PrePost{
+    public:
+        async_prepost(const char* model_path, std::function<PrePost*(const char*)> create_model) : create(create_model){
+            auto promise = std::make_shared<std::promise<void>>();
+            ready = promise->get_future().share();
+            std::string path(model_path);
+            loader_pool::instance().post([this, promise, path](){
+                try{
+                    std::shared_ptr<loaded_model> loaded = load(path);
+                    // Before the model is published, readers synchronize through ready
+                    dynamic_output = loaded->model->dynamic_output;
+                    std::atomic_store(&live, loaded);
+                    promise->set_value();
+                }
+                catch(...){
+                    promise->set_exception(std::current_exception());
+                }
+            });
+        }
+
+        ~async_prepost(){
+            // Never leave the pool building a model for a dead handle
+            ready.wait();
+            std::lock_guard<std::mutex> lock(reload_mutex);
+            if(reloading.valid())
+                reloading.wait();
+        }
+
+        // Rethrows a failed load
+        void wait_ready(){
+            ready.get();
+        }
+
+        // Waits for the model; the returned reference keeps it alive through a call
+        std::shared_ptr<PrePost> get(){
+            ready.get();
+            std::shared_ptr<loaded_model> loaded = std::atomic_load(&live);
+            return std::shared_ptr<PrePost>(loaded, loaded->model.get());
+        }
+
+        // Replaces the model without stopping the stream. The future rethrows a failed
+        // load or a shape mismatch, in which case the live model stays.
+        std::shared_future<void> reload(const char* model_path){
+            std::lock_guard<std::mutex> lock(reload_mutex);
+            auto promise = std::make_shared<std::promise<void>>();
+            std::shared_future<void> previous = reloading;
+            reloading = promise->get_future().share();
+            std::string path(model_path);
+            loader_pool::instance().post([this, promise, previous, path](){
+                try{
+                    // One reload at a time, in the order they were asked for
+                    if(previous.valid())
+                        previous.wait();
+                    ready.get();
+                    std::shared_ptr<loaded_model> next;
+                    {
+                        plugin_warmup::blocking warm(1);
+                        next = load(path);
+                    }
+                    std::shared_ptr<loaded_model> old = std::atomic_load(&live);
+                    check_shapes(*old->model, *next->model, path);
+                    // Calls still running on the old model hold it, the last one to finish hands it back here
+                    old->retired = true;
+                    old = std::atomic_exchange(&live, next);
+                    old.reset();
+                    promise->set_value();
+                }
+                catch(const std::exception& e){
+                    std::cerr << "reload of " << path << " failed, keeping the live model: " << e.what() << std::endl;
+                    promise->set_exception(std::current_exception());
+                }
+                catch(...){
+                    promise->set_exception(std::current_exception());
+                }
+            });
+            return reloading;
+        }
+
+        void runinference(std::vector<MX::Types::FeatureMap<float>*> input, std::vector<MX::Types::FeatureMap<float>*> output) override{
+            get()->runinference(input, output);
+        }
+        void runinference(std::vector<MX::Types::FeatureMap<uint8_t>*> input, std::vector<MX::Types::FeatureMap<uint8_t>*> output) override{
+            get()->runinference(input, output);
+        }
+        std::vector<std::vector<int64_t>> get_input_shapes() override { return get()->get_input_shapes(); }
+        std::vector<std::vector<int64_t>> get_output_shapes() override { return get()->get_output_shapes(); }
+        std::vector<size_t> get_output_sizes() override { return get()->get_output_sizes(); }
+        std::vector<size_t> get_input_sizes() override { return get()->get_input_sizes(); }
+        std::vector<std::string> get_output_names() override { return get()->get_output_names(); }
+        std::vector<std::string> get_input_names() override { return get()->get_input_names(); }
+
+    private:
+        // The plugins keep pointing at their model path, so it lives next to the model
+        struct loaded_model{
+            std::string path;
+            std::unique_ptr<PrePost> model;
+            std::atomic<bool> retired{false};
+        };
+
+        // Tearing down a session takes long: a model replaced by a reload is
+        // destroyed on the loader pool instead of the inference thread that
+        // dropped the last reference to it
+        static void destroy(loaded_model* loaded){
+            if(loaded->retired)
+                loader_pool::instance().post([loaded](){ delete loaded; });
+            else
+                delete loaded;
+        }
+
+        std::shared_ptr<loaded_model> load(const std::string& path){
+            std::shared_ptr<loaded_model> loaded(new loaded_model(), &async_prepost::destroy);
+            loaded->path = path;
+            loaded->model.reset(create(loaded->path.c_str()));
+            return loaded;
+        }
+
+        static void check_shapes(PrePost& old_model, PrePost& new_model, const std::string& path){
+            if(new_model.get_input_shapes() != old_model.get_input_shapes())
+                throw std::runtime_error("reload: input shapes of " + path + " don't match the live model");
+            if(new_model.get_output_shapes() != old_model.get_output_shapes() || new_model.dynamic_output != old_model.dynamic_output)
+                throw std::runtime_error("reload: output shapes of " + path + " don't match the live model");
+        }
+
+        std::function<PrePost*(const char*)> create;
+        std::shared_future<void> ready;
+        std::shared_ptr<loaded_model> live;
+        std::mutex reload_mutex;
+        std::shared_future<void> reloading;
+};
+
+// Body of the createXxxBatch factories: starts every load at once and returns
+// when all models are ready. When one fails, none is returned and the first
+// failure is rethrown. out_sizes is empty or holds the sizes of every model.
+inline std::vector<PrePost*> create_prepost_batch(const char* plugin_name, const std::vector<std::string>& model_paths,
+                                                  const std::vector<std::vector<size_t>>& out_sizes,
+                                                  std::function<PrePost*(const char*, const std::vector<size_t>&)> create_model){
+    if(!out_sizes.empty() && out_sizes.size() != model_paths.size())
+        throw std::runtime_error(std::string(plugin_name) + ": batch needs the output sizes of every model or none");
+    std::vector<std::unique_ptr<async_prepost>> handles;
+    for(size_t i = 0; i < model_paths.size(); ++i){
+        std::vector<size_t> sizes = out_sizes.empty() ? std::vector<size_t>() : out_sizes[i];
+        handles.emplace_back(new async_prepost(model_paths[i].c_str(), [create_model, sizes](const char* path){ return create_model(path, sizes); }));
+    }
+    std::exception_ptr failure;
+    for(auto& handle : handles){
+        try{
+            handle->wait_ready();
+        }
+        catch(...){
+            if(!failure)
+                failure = std::current_exception();
+        }
+    }
+    if(failure)
+        std::rethrow_exception(failure);
+    std::vector<PrePost*> models;
+    for(auto& handle : handles)
+        models.push_back(handle.release());
+    return models;
+}
+
+// Body of the reloadXxx entry points: starts a reload of a handle from the batch
+// factories and, with wait, blocks until it is swapped in or has failed
+inline bool reload_prepost(const char* plugin_name, PrePost* plugin, const char* model_path, bool wait){
+    async_prepost* handle = dynamic_cast<async_prepost*>(plugin);
+    if(handle == nullptr)
+        throw std::runtime_error(std::string(plugin_name) + ": only models from the batch factories can be reloaded");
+    std::shared_future<void> done = handle->reload(model_path);
+    if(!wait)
+        return true;
+    try{
+        done.get();
+        return true;
+    }
+    catch(...){
+        return false;
+    }
+}
+
+#endif
@@ -0,0 +1,215 @@
+#ifndef PLUGIN_AFFINITY
+#define PLUGIN_AFFINITY
+
+#include "plugin_options.h"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#ifdef OS_LINUX
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Placement of the plugin instances on multi-socket machines.
+//   MX_PLUGIN_CPUS         CPU sets the instances run on, separated by ';', e.g.
+//                          "0-15;16-31". Instances take the sets round robin in the
+//                          order they are created. "auto" makes one set per NUMA
+//                          node. Unset (default) leaves placement to the OS.
+//   MX_PLUGIN_NUMA_MEMORY  prefer memory on the NUMA node of the instance's CPU
+//                          set (default 1)
+//
+// The runtime's threads are started while the constructing thread is placed, so
+// they inherit its CPU set and memory policy. Only those threads are pinned: the
+// thread calling runinference isn't the plugin's, and re-pinning it on every call
+// would migrate it back and forth. Scheduler workers (plugin_scheduler.h) run
+// every instance and are left where they are too. The buffers of an instance
+// still come from its node through the pool (plugin_pool.h).
+
+// "0-3,8,10-11" -> {0, 1, 2, 3, 8, 10, 11}, empty when malformed
+inline std::vector<int> parse_cpu_list(const std::string& list){
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while(std::getline(ss, range, ',')){
+        while(!range.empty() && std::isspace((unsigned char)range.back()))
+            range.pop_back();
+        if(range.empty())
+            continue;
+        char* end;
+        long first = std::strtol(range.c_str(), &end, 10);
+        long last = first;
+        if(*end == '-')
+            last = std::strtol(end + 1, &end, 10);
+        if(*end != '\0' || first < 0 || last < first)
+            return {};
+        for(long cpu = first; cpu <= last; ++cpu)
+            cpus.push_back((int)cpu);
+    }
+    return cpus;
+}
+
+class plugin_affinity{
+    private:
+        static constexpr int max_nodes = 1024;
+        static constexpr int mpol_preferred = 1; // MPOL_PREFERRED
+
+    public:
+        // CPUs and NUMA node of one placement, node is -1 when the CPUs span several nodes
+        struct placement{
+            std::string cpu_list;
+            std::vector<int> cpus;
+            int node = -1;
+        };
+
+        plugin_affinity(const char* plugin, const std::string& model){
+#ifdef OS_LINUX
+            const std::vector<placement>& sets = placements();
+            if(sets.empty())
+                return;
+            static std::atomic<size_t> instances{0};
+            where = sets[instances++ % sets.size()];
+            if(!plugin_option_bool("MX_PLUGIN_NUMA_MEMORY", true))
+                memory_node = -1;
+            else
+                memory_node = where.node;
+            std::cerr << plugin << ": running " << model << " on CPUs " << where.cpu_list;
+            if(memory_node >= 0)
+                std::cerr << ", memory on NUMA node " << memory_node;
+            std::cerr << std::endl;
+#else
+            (void)plugin;
+            (void)model;
+#endif
+        }
+
+        bool active() const { return !where.cpus.empty(); }
+
+        // NUMA node the instance's memory should come from, -1 for any
+        int get_node() const { return memory_node; }
+
+        const placement& get_placement() const { return where; }
+
+        // Places the current thread while alive, e.g. while the runtime builds the
+        // model and starts its threads
+        class scope{
+            public:
+                explicit scope(const plugin_affinity& affinity) : owner(affinity){
+#ifdef OS_LINUX
+                    if(!owner.active())
+                        return;
+                    saved = sched_getaffinity(0, sizeof(previous_cpus), &previous_cpus) == 0;
+                    if(owner.memory_node >= 0)
+                        saved_policy = syscall(SYS_get_mempolicy, &previous_mode, previous_nodes, max_nodes + 1, nullptr, 0) == 0;
+                    owner.apply();
+#endif
+                }
+                ~scope(){
+#ifdef OS_LINUX
+                    if(saved)
+                        sched_setaffinity(0, sizeof(previous_cpus), &previous_cpus);
+                    if(saved_policy)
+                        syscall(SYS_set_mempolicy, previous_mode, previous_nodes, max_nodes + 1);
+#endif
+                }
+            private:
+                const plugin_affinity& owner;
+#ifdef OS_LINUX
+                cpu_set_t previous_cpus;
+                bool saved = false;
+                int previous_mode = 0;
+                unsigned long previous_nodes[max_nodes / (8 * sizeof(unsigned long))] = {};
+                bool saved_policy = false;
+#endif
+        };
+
+    private:
+#ifdef OS_LINUX
+        void apply() const {
+            cpu_set_t mask;
+            CPU_ZERO(&mask);
+            for(int cpu : where.cpus)
+                if(cpu < CPU_SETSIZE)
+                    CPU_SET(cpu, &mask);
+            if(sched_setaffinity(0, sizeof(mask), &mask) != 0)
+                std::cerr << "plugin_affinity: couldn't pin to CPUs " << where.cpu_list << std::endl;
+            if(memory_node >= 0 && memory_node < max_nodes){
+                unsigned long nodes[max_nodes / (8 * sizeof(unsigned long))] = {};
+                nodes[memory_node / (8 * sizeof(unsigned long))] |= 1ul << (memory_node % (8 * sizeof(unsigned long)));
+                // Preferred, not bound: a full node falls back to the others instead of failing
+                syscall(SYS_set_mempolicy, mpol_preferred, nodes, max_nodes + 1);
+            }
+        }
+
+        static std::string read_line(const std::string& path){
+            std::ifstream file(path);
+            std::string line;
+            std::getline(file, line);
+            return line;
+        }
+
+        // One placement per online NUMA node
+        static std::vector<placement> numa_placements(){
+            std::vector<placement> sets;
+            for(int node : parse_cpu_list(read_line("/sys/devices/system/node/online"))){
+                placement p;
+                p.cpu_list = read_line("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+                p.cpus = parse_cpu_list(p.cpu_list);
+                p.node = node;
+                if(!p.cpus.empty())
+                    sets.push_back(p);
+            }
+            return sets;
+        }
+
+        static const std::vector<placement>& placements(){
+            static std::vector<placement> sets = [](){
+                std::vector<placement> parsed;
+                std::string option = plugin_option_string("MX_PLUGIN_CPUS", "");
+                if(option.empty())
+                    return parsed;
+                std::vector<placement> nodes = numa_placements();
+                if(option == "auto"){
+                    if(nodes.size() < 2)
+                        std::cerr << "plugin_affinity: single NUMA node, MX_PLUGIN_CPUS=auto pins to it" << std::endl;
+                    return nodes;
+                }
+                std::stringstream ss(option);
+                std::string list;
+                while(std::getline(ss, list, ';')){
+                    placement p;
+                    p.cpu_list = list;
+                    p.cpus = parse_cpu_list(list);
+                    if(p.cpus.empty()){
+                        std::cerr << "plugin_affinity: ignoring malformed CPU set \"" << list << "\"" << std::endl;
+                        continue;
+                    }
+                    // The node holding all of the CPUs, if there is one
+                    for(const placement& n : nodes){
+                        bool inside = true;
+                        for(int cpu : p.cpus)
+                            inside = inside && std::find(n.cpus.begin(), n.cpus.end(), cpu) != n.cpus.end();
+                        if(inside){
+                            p.node = n.node;
+                            break;
+                        }
+                    }
+                    parsed.push_back(p);
+                }
+                return parsed;
+            }();
+            return sets;
+        }
+#endif
+
+        placement where;
+        int memory_node = -1;
+};
+
+#endif
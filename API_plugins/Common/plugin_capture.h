@@ -0,0 +1,204 @@
+#ifndef PLUGIN_CAPTURE
+#define PLUGIN_CAPTURE
+
+#include <memx/accl/prepost.h>
+#include "plugin_options.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <string>
+#include <vector>
+#ifdef OS_LINUX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Capture of the inputs flowing through runinference, for offline replay with
+// mxplugin_replay. Each plugin instance appends to its own memory-mapped file
+// <dir>/<plugin>_<pid>_<n>.mxcap, so a call costs one memcpy per input.
+//   MX_PLUGIN_CAPTURE          directory to capture into, unset disables capture
+//   MX_PLUGIN_CAPTURE_MB       size limit of each file (default 1024), capture stops when full
+//   MX_PLUGIN_CAPTURE_SECONDS  stop after this long (default 0, no limit)
+//
+// File layout, little endian, every block 8-byte aligned:
+//   capture_file_header, plugin name, model path
+//   capture_record, then per input: capture_input, int64 dims[ndims], float data[count]
+//   ...
+// A record is published by writing its magic last; a zero magic ends the stream.
+
+static constexpr char capture_file_magic[8] = {'M', 'X', 'C', 'A', 'P', 'T', 'U', 'R'};
+static constexpr uint32_t capture_record_magic = 0x4d415246; // "FRAM"
+static constexpr uint32_t capture_version = 1;
+
+struct capture_file_header{
+    char magic[8];
+    uint32_t version;
+    uint32_t plugin_length;
+    uint32_t model_length;
+    uint32_t header_bytes; // up to the first record
+};
+
+struct capture_record{
+    uint32_t magic;
+    uint32_t num_inputs;
+    uint64_t bytes;        // whole record
+    uint64_t timestamp_ns; // since the capture started
+    uint64_t duration_ns;  // of the runinference call, 0 when it threw
+};
+
+struct capture_input{
+    uint32_t ndims;
+    uint32_t reserved;
+    uint64_t count;
+};
+
+inline size_t capture_align(size_t bytes){
+    return (bytes + 7) & ~size_t(7);
+}
+
+class plugin_capture{
+    public:
+        plugin_capture(const char* plugin, const std::string& model){
+#ifdef OS_LINUX
+            std::string dir = plugin_option_string("MX_PLUGIN_CAPTURE", "");
+            if(dir.empty())
+                return;
+            static std::atomic<int> instances{0};
+            path = dir + "/" + plugin + "_" + std::to_string(getpid()) + "_" + std::to_string(instances++) + ".mxcap";
+            capacity = (size_t)plugin_option_int("MX_PLUGIN_CAPTURE_MB", 1024) << 20;
+            window_ns = (uint64_t)plugin_option_int("MX_PLUGIN_CAPTURE_SECONDS", 0) * 1000000000ull;
+            fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            // Sparse: only the pages that get written take up space
+            if(fd < 0 || ftruncate(fd, capacity) != 0){
+                std::cerr << plugin << ": couldn't create capture file " << path << std::endl;
+                close_file();
+                return;
+            }
+            void* mapped = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if(mapped == MAP_FAILED){
+                std::cerr << plugin << ": couldn't map capture file " << path << std::endl;
+                close_file();
+                return;
+            }
+            base = static_cast<char*>(mapped);
+
+            capture_file_header header;
+            memcpy(header.magic, capture_file_magic, sizeof(header.magic));
+            header.version = capture_version;
+            header.plugin_length = (uint32_t)strlen(plugin);
+            header.model_length = (uint32_t)model.size();
+            header.header_bytes = (uint32_t)capture_align(sizeof(header) + header.plugin_length + header.model_length);
+            memcpy(base, &header, sizeof(header));
+            memcpy(base + sizeof(header), plugin, header.plugin_length);
+            memcpy(base + sizeof(header) + header.plugin_length, model.data(), header.model_length);
+            tail = header.header_bytes;
+            start = std::chrono::steady_clock::now();
+            std::cerr << plugin << ": capturing the inputs of " << model << " into " << path << std::endl;
+#endif
+        }
+
+        ~plugin_capture(){
+#ifdef OS_LINUX
+            if(base != nullptr){
+                size_t used = std::min(tail.load(), capacity);
+                munmap(base, capacity);
+                if(ftruncate(fd, used) != 0)
+                    std::cerr << "couldn't trim capture file " << path << std::endl;
+            }
+            close_file();
+#endif
+        }
+
+        bool active() const { return base != nullptr && !stopped.load(std::memory_order_relaxed); }
+
+        // One runinference call: the inputs are written on construction, the record
+        // is published with the call's duration on destruction
+        class call{
+            public:
+                call(plugin_capture& capture, const std::vector<MX::Types::FeatureMap<float>*>& input,
+                     const std::vector<size_t>& input_sizes, const std::vector<std::vector<int64_t>>& input_shapes) : owner(capture){
+                    if(owner.active())
+                        record = owner.write(input, input_sizes, input_shapes, begin);
+                }
+                ~call(){
+                    if(record == nullptr)
+                        return;
+                    if(!std::uncaught_exceptions())
+                        record->duration_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+                    std::atomic_thread_fence(std::memory_order_release);
+                    record->magic = capture_record_magic;
+                }
+            private:
+                plugin_capture& owner;
+                capture_record* record = nullptr;
+                std::chrono::steady_clock::time_point begin;
+        };
+
+    private:
+        capture_record* write(const std::vector<MX::Types::FeatureMap<float>*>& input, const std::vector<size_t>& input_sizes,
+                              const std::vector<std::vector<int64_t>>& input_shapes, std::chrono::steady_clock::time_point& begin){
+            begin = std::chrono::steady_clock::now();
+            uint64_t timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(begin - start).count();
+            if(window_ns != 0 && timestamp > window_ns){
+                stop("capture window is over");
+                return nullptr;
+            }
+            size_t bytes = sizeof(capture_record);
+            for(size_t i = 0; i < input.size(); ++i)
+                bytes += sizeof(capture_input) + input_shapes[i].size() * sizeof(int64_t) + capture_align(input_sizes[i] * sizeof(float));
+            size_t offset = tail.fetch_add(bytes);
+            // Keep room for the zero magic that ends the stream
+            if(offset + bytes + sizeof(uint32_t) > capacity){
+                stop("capture file is full");
+                return nullptr;
+            }
+            char* p = base + offset;
+            capture_record* record = reinterpret_cast<capture_record*>(p);
+            record->num_inputs = (uint32_t)input.size();
+            record->bytes = bytes;
+            record->timestamp_ns = timestamp;
+            record->duration_ns = 0;
+            p += sizeof(capture_record);
+            for(size_t i = 0; i < input.size(); ++i){
+                capture_input* in = reinterpret_cast<capture_input*>(p);
+                in->ndims = (uint32_t)input_shapes[i].size();
+                in->reserved = 0;
+                in->count = input_sizes[i];
+                p += sizeof(capture_input);
+                memcpy(p, input_shapes[i].data(), input_shapes[i].size() * sizeof(int64_t));
+                p += input_shapes[i].size() * sizeof(int64_t);
+                memcpy(p, input[i]->get_data_ptr(), input_sizes[i] * sizeof(float));
+                p += capture_align(input_sizes[i] * sizeof(float));
+            }
+            return record;
+        }
+
+        void stop(const char* reason){
+            if(!stopped.exchange(true))
+                std::cerr << path << ": " << reason << ", capture stopped" << std::endl;
+        }
+
+        void close_file(){
+#ifdef OS_LINUX
+            if(fd >= 0)
+                close(fd);
+            fd = -1;
+#endif
+        }
+
+        std::string path;
+        int fd = -1;
+        char* base = nullptr;
+        size_t capacity = 0;
+        uint64_t window_ns = 0;
+        std::atomic<size_t> tail{0};
+        std::atomic<bool> stopped{false};
+        std::chrono::steady_clock::time_point start;
+};
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef PLUGIN_DISPATCH
+#define PLUGIN_DISPATCH
+
+// Shared by the plugins and mxutils_gui, which are built for an SSE4.2 baseline.
+// Loops marked MXUTILS_TARGET_CLONES are also built for x86-64-v3 (AVX2) and v4
+// (AVX-512), AVX2 only on older compilers, and the best one is picked through
+// an ifunc when the library is loaded. NEON is baseline on aarch64, nothing to
+// pick there.
+#if defined(__x86_64__) && defined(__linux__) && defined(__has_attribute)
+#if __has_attribute(target_clones) && !defined(__clang__) && __GNUC__ >= 11
+#define MXUTILS_TARGET_CLONES __attribute__((target_clones("arch=x86-64-v4", "arch=x86-64-v3", "default")))
+#elif __has_attribute(target_clones)
+#define MXUTILS_TARGET_CLONES __attribute__((target_clones("avx2", "default")))
+#endif
+#endif
+
+#ifndef MXUTILS_TARGET_CLONES
+#define MXUTILS_TARGET_CLONES
+#endif
+
+#endif
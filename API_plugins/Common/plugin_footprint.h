@@ -0,0 +1,167 @@
+#ifndef PLUGIN_FOOTPRINT
+#define PLUGIN_FOOTPRINT
+
+#include "plugin_options.h"
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#ifdef OS_LINUX
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Memory a plugin instance holds, by category
+struct plugin_footprint{
+    size_t weights = 0; // model parameters, incl. copies repacked by the runtime
+    size_t graph = 0;   // graph structures kept after loading
+    size_t arena = 0;   // runtime working memory, intermediate tensors
+    size_t io = 0;      // input/output tensors and staging buffers
+
+    size_t total() const { return weights + graph + arena + io; }
+};
+
+// Resident set of the process, 0 where unknown. Growth across a load step is
+// charged to the model being loaded, so it's approximate while several models
+// load at once.
+inline size_t resident_bytes(){
+#ifdef OS_LINUX
+    std::ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    if(statm >> pages >> resident)
+        return resident * (size_t)sysconf(_SC_PAGESIZE);
+#endif
+    return 0;
+}
+
+inline size_t resident_growth(size_t since){
+    size_t now = resident_bytes();
+    return now > since ? now - since : 0;
+}
+
+inline size_t file_bytes(const std::string& path){
+#ifdef OS_LINUX
+    struct stat st;
+    if(stat(path.c_str(), &st) == 0)
+        return (size_t)st.st_size;
+#else
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if(file)
+        return (size_t)file.tellg();
+#endif
+    return 0;
+}
+
+// Process-wide memory budget for the plugin instances, so a box running out of
+// RAM fails at load instead of being OOM-killed mid-stream.
+//   MX_PLUGIN_MEMORY_BUDGET_MB  budget for all instances, 0 (default) means no limit
+//   MX_PLUGIN_BUDGET_LEAN       when a model doesn't fit as is, load it lean if that
+//                               fits (default 1): weights are used as stored
+//                               instead of repacked, at some cost in speed
+//
+// A model is admitted on an estimate from its file size; once loaded, the
+// estimate is replaced with its measured footprint.
+class plugin_budget{
+    public:
+        static plugin_budget& instance(){
+            static plugin_budget budget;
+            return budget;
+        }
+
+        size_t get_limit() const { return limit; }
+
+        size_t get_committed(){
+            std::lock_guard<std::mutex> lock(mutex);
+            return committed;
+        }
+
+        // Held by a plugin instance for its lifetime. Throws when the model
+        // doesn't fit, even lean; lean() tells how to load it otherwise.
+        class ticket{
+            public:
+                ticket(const char* plugin, const std::string& model, double full_factor, double lean_factor) : owner(instance()){
+                    size_t bytes = file_bytes(model);
+                    id = owner.admit(plugin, model, (size_t)(bytes * full_factor), (size_t)(bytes * lean_factor), is_lean);
+                }
+                ~ticket(){ owner.release(id); }
+                ticket(const ticket&) = delete;
+                ticket& operator=(const ticket&) = delete;
+
+                bool lean() const { return is_lean; }
+
+                // What the loaded model really takes replaces the estimate
+                void commit(const plugin_footprint& footprint){ owner.update(id, footprint.total()); }
+
+            private:
+                plugin_budget& owner;
+                int id = -1;
+                bool is_lean = false;
+        };
+
+    private:
+        struct entry{
+            std::string name;
+            size_t bytes;
+        };
+
+        plugin_budget(){
+            limit = (size_t)plugin_option_int("MX_PLUGIN_MEMORY_BUDGET_MB", 0) << 20;
+            lean_fallback = plugin_option_bool("MX_PLUGIN_BUDGET_LEAN", true);
+        }
+
+        int admit(const char* plugin, const std::string& model, size_t full_bytes, size_t lean_bytes, bool& lean){
+            std::lock_guard<std::mutex> lock(mutex);
+            size_t bytes = full_bytes;
+            lean = false;
+            if(limit != 0 && committed + full_bytes > limit){
+                if(!lean_fallback || committed + lean_bytes > limit){
+                    std::ostringstream oss;
+                    oss << plugin << ": loading " << model << " needs about " << (full_bytes >> 20) << " MB";
+                    if(lean_fallback)
+                        oss << " (" << (lean_bytes >> 20) << " MB lean)";
+                    oss << ", " << ((limit - std::min(limit, committed)) >> 20) << " MB of the "
+                        << (limit >> 20) << " MB budget are left. Loaded:";
+                    for(const auto& loaded : entries)
+                        oss << "\n  " << loaded.second.name << "  " << (loaded.second.bytes >> 20) << " MB";
+                    throw std::runtime_error(oss.str());
+                }
+                bytes = lean_bytes;
+                lean = true;
+            }
+            int id = next_id++;
+            entries[id] = entry{model, bytes};
+            committed += bytes;
+            return id;
+        }
+
+        void update(int id, size_t bytes){
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = entries.find(id);
+            if(it == entries.end())
+                return;
+            committed = committed - it->second.bytes + bytes;
+            it->second.bytes = bytes;
+        }
+
+        void release(int id){
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = entries.find(id);
+            if(it == entries.end())
+                return;
+            committed -= it->second.bytes;
+            entries.erase(it);
+        }
+
+        std::mutex mutex;
+        std::map<int, entry> entries;
+        size_t committed = 0;
+        size_t limit = 0;
+        bool lean_fallback = true;
+        int next_id = 0;
+};
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef PLUGIN_FP16
+#define PLUGIN_FP16
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define PLUGIN_FP16_F16C
+#endif
+
+// fp16 <-> fp32 conversion for models that run in half precision. The copies
+// into and out of the framework tensors convert on the fly, F16C on x86 when
+// the CPU has it, NEON on aarch64, else a scalar fallback that rounds to
+// nearest even like the hardware does.
+
+inline uint16_t float_to_half(float value){
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000;
+    bits &= 0x7fffffff;
+    if(bits > 0x7f800000) // nan comes out quiet and keeps the top of its payload, like F16C
+        return sign | 0x7e00 | ((bits & 0x7fffff) >> 13);
+    if(bits == 0x7f800000)
+        return sign | 0x7c00;
+    if(bits >= 0x477ff000) // rounds past 65504
+        return sign | 0x7c00;
+    if(bits < 0x38800000){
+        // Subnormal: adding 0.5 leaves the half mantissa, rounded, in the low bits
+        float magnitude;
+        memcpy(&magnitude, &bits, sizeof(bits));
+        magnitude += 0.5f;
+        memcpy(&bits, &magnitude, sizeof(bits));
+        return sign | (bits - 0x3f000000);
+    }
+    uint32_t odd = (bits >> 13) & 1;
+    bits += 0xc8000fff + odd; // rebias the exponent and round to nearest even
+    return sign | (bits >> 13);
+}
+
+inline float half_to_float(uint16_t half){
+    uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+    uint32_t exponent = (half >> 10) & 0x1f;
+    uint32_t mantissa = half & 0x3ff;
+    uint32_t bits;
+    if(exponent == 0){
+        float magnitude = mantissa * (1.0f / 16777216.0f);
+        memcpy(&bits, &magnitude, sizeof(bits));
+        bits |= sign;
+    }
+    else if(exponent == 31) // inf, nan comes out quiet
+        bits = sign | 0x7f800000 | (mantissa << 13) | (mantissa ? 0x400000 : 0);
+    else
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+#ifdef PLUGIN_FP16_F16C
+__attribute__((target("avx,f16c"))) inline void float_to_half_f16c(const float* src, uint16_t* dst, size_t count){
+    size_t i = 0;
+    for(; i + 8 <= count; i += 8)
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+    for(; i < count; ++i)
+        dst[i] = float_to_half(src[i]);
+}
+
+__attribute__((target("avx,f16c"))) inline void half_to_float_f16c(const uint16_t* src, float* dst, size_t count){
+    size_t i = 0;
+    for(; i + 8 <= count; i += 8)
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i))));
+    for(; i < count; ++i)
+        dst[i] = half_to_float(src[i]);
+}
+
+inline bool has_f16c(){
+    static bool supported = __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+    return supported;
+}
+#endif
+
+inline void float_to_half(const float* src, uint16_t* dst, size_t count){
+    size_t i = 0;
+#if defined(__aarch64__)
+    for(; i + 4 <= count; i += 4)
+        vst1_u16(dst + i, vreinterpret_u16_f16(vcvt_f16_f32(vld1q_f32(src + i))));
+#elif defined(PLUGIN_FP16_F16C)
+    if(has_f16c()){
+        float_to_half_f16c(src, dst, count);
+        return;
+    }
+#endif
+    for(; i < count; ++i)
+        dst[i] = float_to_half(src[i]);
+}
+
+inline void half_to_float(const uint16_t* src, float* dst, size_t count){
+    size_t i = 0;
+#if defined(__aarch64__)
+    for(; i + 4 <= count; i += 4)
+        vst1q_f32(dst + i, vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(src + i))));
+#elif defined(PLUGIN_FP16_F16C)
+    if(has_f16c()){
+        half_to_float_f16c(src, dst, count);
+        return;
+    }
+#endif
+    for(; i < count; ++i)
+        dst[i] = half_to_float(src[i]);
+}
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef PLUGIN_LOADER
+#define PLUGIN_LOADER
+
+#include <memx/accl/prepost.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#ifdef OS_LINUX
+#include <dlfcn.h>
+#endif
+
+// Creates a plugin for a model from its extension, the way MxAccl would:
+// .onnx -> OnnxInfer, .pb -> TfInfer, .tflite -> TfliteInfer. The plugin
+// libraries are looked up next to the calling library first, then in the
+// MxAccl plugin directories, then through the default search path.
+// The plugins keep pointing at model_path, it must outlive the plugin.
+
+typedef PrePost* (*plugin_factory)(const char* model_path, const std::vector<size_t>& out_sizes);
+
+inline bool plugin_for_model(const std::string& model_path, const char*& lib, const char*& factory){
+    auto ends_with = [&model_path](const std::string& suffix){
+        return model_path.size() >= suffix.size() && model_path.compare(model_path.size() - suffix.size(), suffix.size(), suffix) == 0;
+    };
+    if(ends_with(".onnx")){
+        lib = "libonnxinfer.so";
+        factory = "createOnnx";
+    }
+    else if(ends_with(".pb")){
+        lib = "libtfinfer.so";
+        factory = "createTf";
+    }
+    else if(ends_with(".tflite")){
+        lib = "libtfliteinfer.so";
+        factory = "createTflite";
+    }
+    else
+        return false;
+    return true;
+}
+
+inline PrePost* create_plugin(const std::string& model_path, const std::vector<size_t>& out_sizes){
+#ifdef OS_LINUX
+    const char* lib;
+    const char* factory;
+    if(!plugin_for_model(model_path, lib, factory))
+        throw std::runtime_error("no plugin for " + model_path + ", expected .onnx, .pb or .tflite");
+
+    std::vector<std::string> candidates;
+    Dl_info self;
+    if(dladdr(reinterpret_cast<void*>(&plugin_for_model), &self) && self.dli_fname){
+        std::string here(self.dli_fname);
+        size_t slash = here.rfind('/');
+        if(slash != std::string::npos)
+            candidates.push_back(here.substr(0, slash + 1) + lib);
+    }
+    candidates.push_back(std::string("/opt/memryx/accl-plugins/") + lib);
+    candidates.push_back(std::string("/usr/lib/") + lib);
+    candidates.push_back(lib);
+
+    void* handle = nullptr;
+    for(const std::string& candidate : candidates){
+        // Never closed: the plugins' objects and statics live until exit
+        handle = dlopen(candidate.c_str(), RTLD_NOW);
+        if(handle)
+            break;
+    }
+    if(handle == nullptr)
+        throw std::runtime_error(std::string("couldn't load ") + lib + " for " + model_path);
+    plugin_factory create = reinterpret_cast<plugin_factory>(dlsym(handle, factory));
+    if(create == nullptr)
+        throw std::runtime_error(std::string(lib) + " has no " + factory);
+    return create(model_path.c_str(), out_sizes);
+#else
+    (void)out_sizes;
+    throw std::runtime_error("loading " + model_path + ": plugins can only be loaded by path on Linux");
+#endif
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef PLUGIN_OPTIONS
+#define PLUGIN_OPTIONS
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <string>
+
+// The plugins are created by MxAccl through their extern "C" factories, so
+// process-wide knobs are read from MX_PLUGIN_* environment variables.
+
+inline bool plugin_option_bool(const char* name, bool default_value){
+    const char* value = std::getenv(name);
+    if(value == nullptr || *value == '\0')
+        return default_value;
+    std::string lower(value);
+    std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c){ return std::tolower(c); });
+    return !(lower == "0" || lower == "false" || lower == "off");
+}
+
+inline long plugin_option_int(const char* name, long default_value){
+    const char* value = std::getenv(name);
+    if(value == nullptr || *value == '\0')
+        return default_value;
+    char* end;
+    long parsed = std::strtol(value, &end, 10);
+    return (*end == '\0') ? parsed : default_value;
+}
+
+inline std::string plugin_option_string(const char* name, const char* default_value){
+    const char* value = std::getenv(name);
+    return (value == nullptr) ? std::string(default_value) : std::string(value);
+}
+
+#endif
@@ -0,0 +1,311 @@
+#ifndef PLUGIN_POOL
+#define PLUGIN_POOL
+
+#include "plugin_options.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+#ifdef OS_LINUX
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <malloc.h>
+#endif
+
+// Process-wide pooled allocator shared by all plugin instances. ORT sessions get
+// it as their env allocator and TFLite binds its I/O tensors to it, so the
+// buffers of every model are recycled from the same pages instead of each
+// instance growing its own arena.
+//   MX_PLUGIN_SHARED_POOL  use the pool (default 1)
+//   MX_PLUGIN_HUGE_PAGES   0 plain pages, 1 transparent huge pages (default),
+//                          2 explicit 2 MB huge pages, falls back to 1 when none are reserved
+//   MX_PLUGIN_POOL_RETAIN_MB  free large blocks kept for reuse, beyond that they
+//                          are unmapped, largest first (default 256)
+//
+// Blocks are 64-byte aligned. Up to 1 MB they come from power-of-two size
+// classes carved out of 2 MB slabs, larger ones are mapped in 2 MB steps. A
+// free large block is reused for any request it fits without wasting more than
+// half of it. Slabs are never unmapped: the peak of the small blocks stays
+// resident. Every block is charged to the model that allocated it.
+// Models placed on a NUMA node (see plugin_affinity.h) get their blocks from
+// pages bound to that node, kept apart from the other nodes' free lists.
+class plugin_pool{
+    public:
+        static constexpr size_t alignment = 64;
+        static constexpr size_t slab_bytes = 2 << 20;
+
+        struct usage{
+            std::string model;
+            size_t bytes = 0;
+            size_t peak_bytes = 0;
+            size_t allocations = 0;
+            int node = -1;
+        };
+
+        static plugin_pool& instance(){
+            // Never destroyed: plugins and the ORT env may still release blocks from static destructors
+            static plugin_pool* pool = new plugin_pool();
+            return *pool;
+        }
+
+        static bool enabled(){
+            static bool on = plugin_option_bool("MX_PLUGIN_SHARED_POOL", true);
+            return on;
+        }
+
+        // Charges the allocations made on this thread, e.g. by ORT inside a Run, to a model
+        class scope{
+            public:
+                explicit scope(int model) : previous(current()) { current() = model; }
+                ~scope(){ current() = previous; }
+            private:
+                int previous;
+        };
+
+        int register_model(const std::string& name, int node = -1){
+            std::lock_guard<std::mutex> lock(mutex);
+            models.push_back(usage());
+            models.back().model = name;
+            models.back().node = node;
+            return (int)models.size() - 1;
+        }
+
+        void* allocate(size_t bytes){
+            return allocate(bytes, current());
+        }
+
+        void* allocate(size_t bytes, int model){
+            size_t needed = bytes + alignment;
+            std::lock_guard<std::mutex> lock(mutex);
+            int node = (model >= 0 && model < (int)models.size()) ? models[model].node : -1;
+            arena& free_lists = arenas[node];
+            header* block;
+            if(needed <= max_class_bytes){
+                int size_class = class_of(needed);
+                block = pop_small(free_lists, size_class, node);
+                if(block == nullptr)
+                    return nullptr;
+                block->size_class = size_class;
+            }
+            else{
+                size_t mapped = (needed + slab_bytes - 1) / slab_bytes * slab_bytes;
+                block = pop_large(free_lists, mapped, node);
+                if(block == nullptr)
+                    return nullptr;
+                block->size_class = -1;
+                block->mapped = mapped;
+            }
+            block->model = model;
+            block->node = node;
+            block->bytes = block_bytes(block);
+            charge(model, (long long)block->bytes);
+            return reinterpret_cast<char*>(block) + alignment;
+        }
+
+        void deallocate(void* ptr){
+            if(ptr == nullptr)
+                return;
+            header* block = reinterpret_cast<header*>(static_cast<char*>(ptr) - alignment);
+            std::lock_guard<std::mutex> lock(mutex);
+            charge(block->model, -(long long)block->bytes);
+            arena& free_lists = arenas[block->node];
+            if(block->size_class >= 0){
+                free_lists.free_small[block->size_class].push_back(block);
+                return;
+            }
+            free_lists.free_large.emplace(block->mapped, block);
+            retained += block->mapped;
+            while(retained > retain_limit)
+                unmap_largest(free_lists);
+        }
+
+        std::vector<usage> get_usage(){
+            std::lock_guard<std::mutex> lock(mutex);
+            return models;
+        }
+
+        usage get_usage(int model){
+            std::lock_guard<std::mutex> lock(mutex);
+            return (model >= 0 && model < (int)models.size()) ? models[model] : usage();
+        }
+
+        // Bytes mapped by the pool, used or free
+        size_t get_reserved_bytes(){
+            std::lock_guard<std::mutex> lock(mutex);
+            return reserved;
+        }
+
+    private:
+        // Sits in the 64 bytes in front of every block
+        struct header{
+            int size_class;
+            int model;
+            int node;
+            size_t bytes;
+            size_t mapped;
+        };
+        static_assert(sizeof(header) <= alignment, "pool header must fit in the alignment padding");
+
+        static constexpr size_t max_class_bytes = 1 << 20;
+        static constexpr int num_classes = 15; // 64 B .. 1 MB
+
+        // Free blocks of one NUMA node, -1 for unplaced models
+        struct arena{
+            std::vector<header*> free_small[num_classes];
+            std::multimap<size_t, header*> free_large;
+        };
+
+        plugin_pool(){
+            huge_pages = (int)plugin_option_int("MX_PLUGIN_HUGE_PAGES", 1);
+            retain_limit = (size_t)std::max(0L, plugin_option_int("MX_PLUGIN_POOL_RETAIN_MB", 256)) << 20;
+        }
+
+        static int& current(){
+            thread_local int model = -1;
+            return model;
+        }
+
+        static int class_of(size_t bytes){
+            int size_class = 0;
+            while(((size_t)alignment << size_class) < bytes)
+                ++size_class;
+            return size_class;
+        }
+
+        static size_t block_bytes(const header* block){
+            return block->size_class >= 0 ? ((size_t)alignment << block->size_class) : block->mapped;
+        }
+
+        void charge(int model, long long bytes){
+            if(model < 0 || model >= (int)models.size())
+                return;
+            usage& u = models[model];
+            u.bytes += bytes;
+            if(bytes > 0){
+                ++u.allocations;
+                u.peak_bytes = std::max(u.peak_bytes, u.bytes);
+            }
+        }
+
+        header* pop_small(arena& free_lists, int size_class, int node){
+            std::vector<header*>& free_list = free_lists.free_small[size_class];
+            if(free_list.empty()){
+                size_t block = (size_t)alignment << size_class;
+                char* slab = static_cast<char*>(map(slab_bytes, node));
+                if(slab == nullptr)
+                    return nullptr;
+                for(size_t offset = 0; offset + block <= slab_bytes; offset += block)
+                    free_list.push_back(reinterpret_cast<header*>(slab + offset));
+            }
+            header* block = free_list.back();
+            free_list.pop_back();
+            return block;
+        }
+
+        // Smallest free block the request fits, as long as at least half of it is used
+        header* pop_large(arena& free_lists, size_t& mapped, int node){
+            auto it = free_lists.free_large.lower_bound(mapped);
+            if(it != free_lists.free_large.end() && it->first / 2 <= mapped){
+                header* block = it->second;
+                mapped = it->first;
+                retained -= mapped;
+                free_lists.free_large.erase(it);
+                return block;
+            }
+            return static_cast<header*>(map(mapped, node));
+        }
+
+        // The limit covers every node, so the largest free block of any of them goes;
+        // on a tie, one of another node than the block just freed into
+        void unmap_largest(const arena& freed_into){
+            arena* from = nullptr;
+            for(auto& a : arenas){
+                if(a.second.free_large.empty())
+                    continue;
+                size_t size = std::prev(a.second.free_large.end())->first;
+                size_t largest = from == nullptr ? 0 : std::prev(from->free_large.end())->first;
+                if(from == nullptr || size > largest || (size == largest && from == &freed_into))
+                    from = &a.second;
+            }
+            auto largest = std::prev(from->free_large.end());
+            retained -= largest->first;
+            unmap(largest->second, largest->first);
+            from->free_large.erase(largest);
+        }
+
+        void* map(size_t bytes, int node){
+            void* data = nullptr;
+#ifdef OS_LINUX
+            if(huge_pages >= 2){
+                data = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+                if(data == MAP_FAILED){
+                    std::cerr << "plugin_pool: no explicit huge pages reserved, using transparent huge pages" << std::endl;
+                    huge_pages = 1;
+                    data = nullptr;
+                }
+            }
+            if(data == nullptr){
+                // 2 MB aligned, so the kernel can back the whole mapping with huge pages
+                size_t padded = bytes + slab_bytes;
+                char* raw = static_cast<char*>(mmap(nullptr, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+                if(raw == MAP_FAILED)
+                    return nullptr;
+                char* aligned = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(raw) + slab_bytes - 1) / slab_bytes * slab_bytes);
+                if(aligned != raw)
+                    munmap(raw, aligned - raw);
+                if(aligned + bytes != raw + padded)
+                    munmap(aligned + bytes, (raw + padded) - (aligned + bytes));
+                data = aligned;
+#ifdef MADV_HUGEPAGE
+                if(huge_pages >= 1)
+                    madvise(data, bytes, MADV_HUGEPAGE);
+#endif
+            }
+            // Before the first touch, so the pages get allocated on the node
+            if(node >= 0 && node < 1024){
+                unsigned long nodes[1024 / (8 * sizeof(unsigned long))] = {};
+                nodes[node / (8 * sizeof(unsigned long))] |= 1ul << (node % (8 * sizeof(unsigned long)));
+                syscall(SYS_mbind, data, bytes, 1 /* MPOL_PREFERRED */, nodes, 1024 + 1, 0);
+            }
+#else
+            (void)node;
+            data = _aligned_malloc(bytes, alignment);
+#endif
+            if(data != nullptr)
+                reserved += bytes;
+            return data;
+        }
+
+        void unmap(void* data, size_t bytes){
+#ifdef OS_LINUX
+            munmap(data, bytes);
+#else
+            _aligned_free(data);
+#endif
+            reserved -= bytes;
+        }
+
+        std::mutex mutex;
+        std::map<int, arena> arenas;
+        std::vector<usage> models;
+        size_t reserved = 0;
+        size_t retained = 0; // free large blocks, all nodes
+        size_t retain_limit;
+        int huge_pages;
+};
+
+// Deleter for buffers owned through unique_ptr
+struct pool_deleter{
+    void operator()(void* p) const { plugin_pool::instance().deallocate(p); }
+};
+
+#endif
@@ -0,0 +1,153 @@
+#ifndef PLUGIN_REUSE
+#define PLUGIN_REUSE
+
+#include <memx/accl/prepost.h>
+#include "plugin_options.h"
+#include "plugin_dispatch.h"
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+
+// Temporal reuse: on static scenes successive inputs are often identical, so a
+// plugin can hand back the outputs of the last run without invoking the model.
+//   MX_PLUGIN_REUSE            enable the cache (default 0)
+//   MX_PLUGIN_REUSE_TOLERANCE  0 (default) reuses on bit-identical inputs, checked
+//                              through a 64-bit hash; above 0 reuses while every
+//                              input value stays within this distance of the
+//                              frame the cached outputs came from
+class plugin_reuse{
+    public:
+        plugin_reuse(){
+            enabled = plugin_option_bool("MX_PLUGIN_REUSE", false);
+            tolerance = std::strtof(plugin_option_string("MX_PLUGIN_REUSE_TOLERANCE", "0").c_str(), nullptr);
+        }
+
+        // True when the outputs were filled from the cache
+        bool lookup(const std::vector<MX::Types::FeatureMap<float>*>& input, const std::vector<size_t>& input_sizes,
+                    std::vector<MX::Types::FeatureMap<float>*>& output){
+            if(!enabled)
+                return false;
+            for(size_t size : input_sizes){
+                if(size == 0){ // size only known per frame, nothing to compare against
+                    enabled = false;
+                    return false;
+                }
+            }
+            bool hit = valid && input.size() == input_sizes.size();
+            if(tolerance > 0){
+                for(size_t i = 0; hit && i < input.size(); ++i)
+                    hit = within(input[i]->get_data_ptr(), reference[i].data(), input_sizes[i], tolerance);
+            }
+            else{
+                pending_hash = 0;
+                for(size_t i = 0; i < input.size(); ++i)
+                    pending_hash = hash(input[i]->get_data_ptr(), input_sizes[i] * sizeof(float), pending_hash);
+                hit = hit && pending_hash == reference_hash;
+            }
+            if(!hit){
+                ++misses;
+                return false;
+            }
+            for(size_t j = 0; j < output.size(); ++j){
+                if(raw_outputs)
+                    memcpy(output[j]->get_data_ptr(), outputs[j].data(), outputs[j].size() * sizeof(float));
+                else
+                    output[j]->set_data(outputs[j].data());
+            }
+            ++hits;
+            return true;
+        }
+
+        // After a miss: the run that just finished becomes the cached one. Dynamic
+        // outputs pass their valid element counts and are copied raw.
+        void store(const std::vector<MX::Types::FeatureMap<float>*>& input, const std::vector<size_t>& input_sizes,
+                   std::vector<MX::Types::FeatureMap<float>*>& output, const std::vector<size_t>& output_counts, bool raw){
+            if(!enabled)
+                return;
+            if(tolerance > 0){
+                reference.resize(input.size());
+                for(size_t i = 0; i < input.size(); ++i)
+                    reference[i].assign(input[i]->get_data_ptr(), input[i]->get_data_ptr() + input_sizes[i]);
+            }
+            else
+                reference_hash = pending_hash;
+            raw_outputs = raw;
+            outputs.resize(output.size());
+            for(size_t j = 0; j < output.size(); ++j){
+                outputs[j].resize(output_counts[j]);
+                if(raw)
+                    memcpy(outputs[j].data(), output[j]->get_data_ptr(), output_counts[j] * sizeof(float));
+                else
+                    output[j]->get_data(outputs[j].data());
+            }
+            valid = true;
+        }
+
+        uint64_t get_hits() const { return hits; }
+        uint64_t get_misses() const { return misses; }
+
+    private:
+        // CRC32C over four interleaved streams where SSE4.2 is the baseline,
+        // a multiply-xor hash elsewhere
+        static uint64_t hash(const void* data, size_t bytes, uint64_t seed){
+            const uint8_t* p = static_cast<const uint8_t*>(data);
+            uint64_t words[4];
+            size_t i = 0;
+#if defined(__SSE4_2__)
+            uint32_t crc[4] = {(uint32_t)seed, (uint32_t)(seed >> 32), 0x9e3779b9u, 0x7f4a7c15u};
+            for(; i + 32 <= bytes; i += 32){
+                memcpy(words, p + i, 32);
+                for(int k = 0; k < 4; ++k)
+                    crc[k] = (uint32_t)_mm_crc32_u64(crc[k], words[k]);
+            }
+            uint64_t h = ((uint64_t)crc[0] << 32 | crc[1]) ^ (((uint64_t)crc[2] << 32 | crc[3]) * 0x9e3779b97f4a7c15ull);
+#else
+            uint64_t lanes[4] = {seed, seed ^ 0x9e3779b97f4a7c15ull, seed ^ 0xc2b2ae3d27d4eb4full, seed ^ 0x165667b19e3779f9ull};
+            for(; i + 32 <= bytes; i += 32){
+                memcpy(words, p + i, 32);
+                for(int k = 0; k < 4; ++k)
+                    lanes[k] = (lanes[k] ^ words[k]) * 0x9e3779b97f4a7c15ull;
+            }
+            uint64_t h = lanes[0] ^ (lanes[1] >> 17) ^ (lanes[2] << 23) ^ (lanes[3] >> 31);
+#endif
+            for(; i < bytes; ++i)
+                h = (h ^ p[i]) * 0x100000001b3ull;
+            return (h ^ (h >> 29)) * 0xbf58476d1ce4e5b9ull ^ bytes;
+        }
+
+        // Compared in blocks the compiler can vectorize, with an exit after each block
+        // that has a value which moved too far; nan never matches
+        MXUTILS_TARGET_CLONES static bool within(const float* a, const float* b, size_t count, float tolerance){
+            size_t i = 0;
+            for(; i + 64 <= count; i += 64){
+                int moved = 0;
+                for(size_t k = i; k < i + 64; ++k)
+                    moved |= !(std::fabs(a[k] - b[k]) <= tolerance);
+                if(moved)
+                    return false;
+            }
+            for(; i < count; ++i)
+                if(!(std::fabs(a[i] - b[i]) <= tolerance))
+                    return false;
+            return true;
+        }
+
+        bool enabled;
+        float tolerance;
+        bool valid = false;
+        bool raw_outputs = false;
+        uint64_t pending_hash = 0;
+        uint64_t reference_hash = 0;
+        std::vector<std::vector<float>> reference;
+        std::vector<std::vector<float>> outputs;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+};
+
+#endif
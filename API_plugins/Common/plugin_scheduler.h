@@ -0,0 +1,363 @@
+#ifndef PLUGIN_SCHEDULER
+#define PLUGIN_SCHEDULER
+
+#include <memx/accl/prepost.h>
+#include "plugin_options.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Shared scheduler for the runinference calls of all plugin instances. Each
+// instance is a stream with a priority and a deadline; calls of all streams
+// are queued in one heap and run on a worker pool highest priority first,
+// earliest deadline first within a priority. A burst on low-priority streams
+// then waits instead of delaying the critical ones.
+//   MX_PLUGIN_SCHEDULER            route runinference through the scheduler (default 0)
+//   MX_PLUGIN_SCHED_THREADS        worker threads (default number of cores)
+//   MX_PLUGIN_SCHED_RESERVED       workers that only run streams of priority > 0 (default 0)
+//   MX_PLUGIN_SCHED_PRIORITY       priority of the streams, higher runs first (default 0)
+//   MX_PLUGIN_SCHED_DEADLINE_MS    time a call has from being submitted, 0 for none (default 0)
+//   MX_PLUGIN_SCHED_SHED           drop calls that missed their deadline before they ran (default 1)
+//   MX_PLUGIN_STREAMS              per-model overrides, "pattern=priority,deadline_ms;...",
+//                                  the first pattern found in the model path applies
+//
+// A dropped call leaves zeros in the outputs and counts as shed in the stats.
+class plugin_scheduler{
+    public:
+        struct stream_stats{
+            std::string name;
+            int priority = 0;
+            double deadline_ms = 0;
+            uint64_t submitted = 0;
+            uint64_t completed = 0;
+            uint64_t missed = 0; // completed after the deadline
+            uint64_t shed = 0;   // dropped, deadline already missed when dispatched
+            double mean_ms = 0;  // submit to completion, completed calls
+            double p50_ms = 0;
+            double p99_ms = 0;
+            double max_ms = 0;
+        };
+
+        static plugin_scheduler& instance(){
+            // Never destroyed: plugins may still submit from static destructors
+            static plugin_scheduler* scheduler = new plugin_scheduler();
+            return *scheduler;
+        }
+
+        static bool enabled(){
+            static bool on = plugin_option_bool("MX_PLUGIN_SCHEDULER", false);
+            return on;
+        }
+
+        int register_stream(const std::string& name){
+            int priority = (int)plugin_option_int("MX_PLUGIN_SCHED_PRIORITY", 0);
+            double deadline_ms = std::strtod(plugin_option_string("MX_PLUGIN_SCHED_DEADLINE_MS", "0").c_str(), nullptr);
+            override_for(name, priority, deadline_ms);
+            std::lock_guard<std::mutex> lock(streams_mutex);
+            streams.emplace_back(new stream_state());
+            stream_state& s = *streams.back();
+            s.name = name;
+            s.priority = priority;
+            s.deadline_ns = (int64_t)(deadline_ms * 1e6);
+            return (int)streams.size() - 1;
+        }
+
+        void set_stream(int stream, int priority, double deadline_ms){
+            stream_state& s = state(stream);
+            s.priority = priority;
+            s.deadline_ns = (int64_t)(deadline_ms * 1e6);
+        }
+
+        // Runs fn on the pool and waits for it; false when the call was shed.
+        // Calls made from a worker, e.g. a chain stage, run inline.
+        bool run(int stream, const std::function<void()>& fn){
+            if(on_worker()){
+                fn();
+                return true;
+            }
+            stream_state& s = state(stream);
+            job j;
+            j.fn = &fn;
+            j.stream = stream;
+            j.priority = s.priority.load(std::memory_order_relaxed);
+            j.submitted = now_ns();
+            int64_t deadline = s.deadline_ns.load(std::memory_order_relaxed);
+            j.deadline = deadline > 0 ? j.submitted + deadline : INT64_MAX;
+            j.seq = sequence++;
+            s.submitted++;
+            submit(&j);
+
+            std::unique_lock<std::mutex> lock(j.mutex);
+            j.finished.wait(lock, [&j](){ return j.done; });
+            if(j.error)
+                std::rethrow_exception(j.error);
+            return !j.shed;
+        }
+
+        stream_stats get_stats(int stream){
+            stream_state& s = state(stream);
+            std::lock_guard<std::mutex> lock(s.mutex);
+            stream_stats stats;
+            stats.name = s.name;
+            stats.priority = s.priority;
+            stats.deadline_ms = s.deadline_ns / 1e6;
+            stats.submitted = s.submitted;
+            stats.completed = s.completed;
+            stats.missed = s.missed;
+            stats.shed = s.shed;
+            stats.mean_ms = s.completed ? s.total_ms / s.completed : 0;
+            stats.p50_ms = s.percentile(50);
+            stats.p99_ms = s.percentile(99);
+            stats.max_ms = s.max_ms;
+            return stats;
+        }
+
+        std::vector<stream_stats> get_stats(){
+            size_t count;
+            {
+                std::lock_guard<std::mutex> lock(streams_mutex);
+                count = streams.size();
+            }
+            std::vector<stream_stats> all;
+            for(size_t i = 0; i < count; ++i)
+                all.push_back(get_stats((int)i));
+            return all;
+        }
+
+    private:
+        // On the stack of the submitting thread until it is done
+        struct job{
+            const std::function<void()>* fn;
+            int stream;
+            int priority;
+            int64_t submitted;
+            int64_t deadline;
+            uint64_t seq;
+            std::mutex mutex;
+            std::condition_variable finished;
+            bool done = false;
+            bool shed = false;
+            std::exception_ptr error;
+        };
+
+        // Latencies in a log histogram, 4 buckets per power of two from 1 us
+        static constexpr int num_buckets = 128;
+
+        struct stream_state{
+            std::string name;
+            std::atomic<int> priority{0};
+            std::atomic<int64_t> deadline_ns{0};
+            std::atomic<uint64_t> submitted{0};
+            std::mutex mutex;
+            uint64_t completed = 0;
+            uint64_t missed = 0;
+            uint64_t shed = 0;
+            double total_ms = 0;
+            double max_ms = 0;
+            uint64_t buckets[num_buckets] = {};
+
+            void record(double ms){
+                double us = std::max(ms * 1e3, 1.0);
+                int bucket = std::min(num_buckets - 1, (int)(4 * std::log2(us)));
+                ++buckets[bucket];
+                total_ms += ms;
+                max_ms = std::max(max_ms, ms);
+            }
+
+            // Upper edge of the bucket holding the percentile
+            double percentile(double p) const {
+                uint64_t target = (uint64_t)std::ceil(p / 100.0 * completed);
+                uint64_t seen = 0;
+                for(int b = 0; b < num_buckets; ++b){
+                    seen += buckets[b];
+                    if(seen >= target && seen > 0)
+                        return std::min(max_ms, std::exp2((b + 1) / 4.0) / 1e3);
+                }
+                return 0;
+            }
+        };
+
+        // More urgent first: higher priority, then earlier deadline, then submission order
+        static bool less_urgent(const job* a, const job* b){
+            if(a->priority != b->priority)
+                return a->priority < b->priority;
+            if(a->deadline != b->deadline)
+                return a->deadline > b->deadline;
+            return a->seq > b->seq;
+        }
+
+        plugin_scheduler(){
+            long threads = plugin_option_int("MX_PLUGIN_SCHED_THREADS", (long)std::max(1u, std::thread::hardware_concurrency()));
+            threads = std::max(1L, threads);
+            reserved = (int)std::min(threads - 1, std::max(0L, plugin_option_int("MX_PLUGIN_SCHED_RESERVED", 0)));
+            shed_late = plugin_option_bool("MX_PLUGIN_SCHED_SHED", true);
+            for(long i = 0; i < threads; ++i)
+                std::thread(&plugin_scheduler::work, this, (int)i).detach();
+        }
+
+        static int64_t now_ns(){
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        static bool& on_worker(){
+            thread_local bool worker = false;
+            return worker;
+        }
+
+        stream_state& state(int stream){
+            std::lock_guard<std::mutex> lock(streams_mutex);
+            return *streams.at(stream);
+        }
+
+        static void override_for(const std::string& name, int& priority, double& deadline_ms){
+            std::stringstream ss(plugin_option_string("MX_PLUGIN_STREAMS", ""));
+            std::string entry;
+            while(std::getline(ss, entry, ';')){
+                size_t eq = entry.find('=');
+                if(eq == std::string::npos || eq == 0 || name.find(entry.substr(0, eq)) == std::string::npos)
+                    continue;
+                const char* values = entry.c_str() + eq + 1;
+                char* end;
+                priority = (int)std::strtol(values, &end, 10);
+                if(*end == ',')
+                    deadline_ms = std::strtod(end + 1, nullptr);
+                return;
+            }
+        }
+
+        void submit(job* j){
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            heap.push_back(j);
+            std::push_heap(heap.begin(), heap.end(), less_urgent);
+            // One job, one worker: a reserved one when it may run it, they are kept free for that
+            if(j->priority > 0 && idle_reserved > 0)
+                urgent_ready.notify_one();
+            else if(idle_general > 0)
+                ready.notify_one();
+        }
+
+        // Whether the most urgent job may run on this worker, reserved ones skip priority <= 0
+        bool runnable(bool reserved_worker) const {
+            return !heap.empty() && (!reserved_worker || heap.front()->priority > 0);
+        }
+
+        void work(int index){
+            on_worker() = true;
+            bool reserved_worker = index < reserved;
+            int& idle_count = reserved_worker ? idle_reserved : idle_general;
+            std::condition_variable& wakeup = reserved_worker ? urgent_ready : ready;
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            for(;;){
+                if(!runnable(reserved_worker)){
+                    ++idle_count;
+                    wakeup.wait(lock, [this, reserved_worker](){ return runnable(reserved_worker); });
+                    --idle_count;
+                }
+                std::pop_heap(heap.begin(), heap.end(), less_urgent);
+                job* j = heap.back();
+                heap.pop_back();
+                lock.unlock();
+                run_job(j);
+                lock.lock();
+            }
+        }
+
+        void run_job(job* j){
+            stream_state& s = state(j->stream);
+            bool shed = shed_late && now_ns() > j->deadline;
+            std::exception_ptr error;
+            if(!shed){
+                try{
+                    (*j->fn)();
+                }
+                catch(...){
+                    error = std::current_exception();
+                }
+            }
+            int64_t finished = now_ns();
+            {
+                std::lock_guard<std::mutex> lock(s.mutex);
+                if(shed)
+                    ++s.shed;
+                else{
+                    ++s.completed;
+                    if(finished > j->deadline)
+                        ++s.missed;
+                    s.record((finished - j->submitted) / 1e6);
+                }
+            }
+            std::lock_guard<std::mutex> lock(j->mutex);
+            j->shed = shed;
+            j->error = error;
+            j->done = true;
+            j->finished.notify_one();
+        }
+
+        // All queued calls in one heap, so the most urgent runs next whichever stream it is from
+        std::mutex queue_mutex;
+        std::vector<job*> heap;
+        std::condition_variable ready;        // general workers
+        std::condition_variable urgent_ready; // reserved workers
+        int idle_general = 0;
+        int idle_reserved = 0;
+        int reserved = 0;
+        bool shed_late = true;
+        std::atomic<uint64_t> sequence{0};
+        std::mutex streams_mutex;
+        std::vector<std::unique_ptr<stream_state>> streams;
+};
+
+// The stream of one plugin instance; runs inline when the scheduler is off
+class plugin_stream{
+    public:
+        explicit plugin_stream(const std::string& model){
+            if(plugin_scheduler::enabled())
+                id = plugin_scheduler::instance().register_stream(model);
+        }
+
+        bool scheduled() const { return id >= 0; }
+
+        // False when the call was shed, the outputs are then zeroed; get_sizes()
+        // returns the output sizes and is only called then
+        template<typename Sizes>
+        bool run(std::vector<MX::Types::FeatureMap<float>*>& output, const Sizes& get_sizes,
+                 const std::function<void()>& fn){
+            if(id < 0){
+                fn();
+                return true;
+            }
+            if(plugin_scheduler::instance().run(id, fn))
+                return true;
+            std::vector<size_t> output_sizes = get_sizes();
+            for(size_t j = 0; j < output.size() && j < output_sizes.size(); ++j)
+                memset(output[j]->get_data_ptr(), 0, output_sizes[j] * sizeof(float));
+            return false;
+        }
+
+        void set(int priority, double deadline_ms){
+            if(id >= 0)
+                plugin_scheduler::instance().set_stream(id, priority, deadline_ms);
+        }
+
+        plugin_scheduler::stream_stats get_stats() const {
+            return id >= 0 ? plugin_scheduler::instance().get_stats(id) : plugin_scheduler::stream_stats();
+        }
+
+    private:
+        int id = -1;
+};
+
+#endif
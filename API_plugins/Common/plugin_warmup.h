@@ -0,0 +1,82 @@
+#ifndef PLUGIN_WARMUP
+#define PLUGIN_WARMUP
+
+#include "plugin_options.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <string>
+
+// Optional warm-up at load. A few dummy inferences take the lazy initialization
+// of the runtime, the first arena growth and the cold caches out of the first frame.
+//   MX_PLUGIN_WARMUP_RUNS   dummy inferences per model, 0 (default) disables warm-up
+//   MX_PLUGIN_WARMUP_ASYNC  warm up in the background, so all models being loaded
+//                           warm up in parallel (default 1); the first runinference waits
+class plugin_warmup{
+    public:
+        ~plugin_warmup(){ finish(); }
+
+        // Models constructed on this thread meanwhile warm up before their
+        // constructor returns, with at least min_runs runs (used by reloads)
+        class blocking{
+            public:
+                explicit blocking(long min_runs) : previous(forced_runs()) { forced_runs() = min_runs; }
+                ~blocking(){ forced_runs() = previous; }
+            private:
+                long previous;
+        };
+
+        template<typename F>
+        void start(const char* plugin, const std::string& model, F run_once){
+            long runs = std::max(plugin_option_int("MX_PLUGIN_WARMUP_RUNS", 0), forced_runs());
+            if(runs <= 0)
+                return;
+            auto task = [this, runs, plugin, model, run_once](){
+                auto start_time = std::chrono::steady_clock::now();
+                for(long i = 0; i < runs; ++i)
+                    run_once();
+                double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_time).count();
+                elapsed = ms;
+                std::cerr << plugin << ": warmed up " << model << " in " << ms << " ms (" << runs << " runs)" << std::endl;
+            };
+            if(forced_runs() == 0 && plugin_option_bool("MX_PLUGIN_WARMUP_ASYNC", true))
+                done = std::async(std::launch::async, task);
+            else
+                task();
+        }
+
+        // Before touching the runtime again; rethrows a warm-up failure once
+        void wait(){
+            if(done.valid())
+                done.get();
+        }
+
+        // Before destroying the runtime, never throws
+        void finish(){
+            if(done.valid())
+                done.wait();
+        }
+
+        // 0 while an async warm-up is still running
+        double elapsed_ms() const { return elapsed; }
+
+    private:
+        static long& forced_runs(){
+            thread_local long runs = 0;
+            return runs;
+        }
+
+        std::future<void> done;
+        std::atomic<double> elapsed{0};
+};
+
+// Writes every page, so the first frame does not page-fault its I/O buffers in
+inline void prefault(void* data, size_t bytes){
+    if(data != nullptr)
+        memset(data, 0, bytes);
+}
+
+#endif
@@ -0,0 +1,247 @@
+#include "FanOutInfer.h"
+#include "plugin_loader.h"
+#include "plugin_options.h"
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+PrePost* createFanOut(const char* model_path, const std::vector<size_t>& out_sizes) {
+    return new FanOutInfer(model_path, out_sizes);
+}
+
+PrePost* createFanOutFrom(const std::vector<PrePost*>& models) {
+    return new FanOutInfer(models);
+}
+
+// "pose.onnx|1000,2000" is the path and the output sizes of one head
+static std::vector<size_t> split_sizes(std::string& path){
+    std::vector<size_t> sizes;
+    size_t bar = path.find('|');
+    if(bar == std::string::npos)
+        return sizes;
+    std::stringstream ss(path.substr(bar + 1));
+    path.resize(bar);
+    std::string size;
+    while(std::getline(ss, size, ',')){
+        char* end = nullptr;
+        unsigned long long value = strtoull(size.c_str(), &end, 10);
+        if(value == 0 || *end != '\0')
+            throw std::runtime_error("FanOutInfer: bad output size '" + size + "' for " + path);
+        sizes.push_back((size_t)value);
+    }
+    return sizes;
+}
+
+FanOutInfer::FanOutInfer(const char* model_path, const std::vector<size_t>& out_sizes){
+    std::stringstream ss(model_path);
+    std::string path;
+    std::vector<std::vector<size_t>> head_sizes;
+    while(std::getline(ss, path, ';')){
+        if(path.empty())
+            continue;
+        head_sizes.push_back(split_sizes(path));
+        model_paths.push_back(path);
+    }
+    // A head's output count is only known once it is loaded, so each head takes its
+    // sizes from the model string; out_sizes go to the last head when it has none there
+    if(!head_sizes.empty() && head_sizes.back().empty())
+        head_sizes.back() = out_sizes;
+    for(size_t k = 0; k < model_paths.size(); ++k){
+        heads.emplace_back(new head());
+        heads.back()->model.reset(create_plugin(model_paths[k], head_sizes[k]));
+    }
+    init();
+}
+
+FanOutInfer::FanOutInfer(const std::vector<PrePost*>& models){
+    for(PrePost* model : models){
+        heads.emplace_back(new head());
+        heads.back()->model.reset(model);
+    }
+    init();
+}
+
+void FanOutInfer::init(){
+    if(heads.empty())
+        throw std::runtime_error("FanOutInfer: no models to fan out to");
+    size_t outputs = 0;
+    dynamic_output = false;
+    for(size_t k = 0; k < heads.size(); ++k){
+        link(k);
+        heads[k]->first_output = outputs;
+        heads[k]->num_outputs = heads[k]->model->get_output_sizes().size();
+        outputs += heads[k]->num_outputs;
+        dynamic_output = dynamic_output || heads[k]->model->dynamic_output;
+    }
+
+    long threads = plugin_option_int("MX_PLUGIN_FANOUT_THREADS", (long)heads.size() - 1);
+    for(long t = 0; t < threads; ++t)
+        workers.emplace_back(&FanOutInfer::work, this);
+}
+
+void FanOutInfer::link(size_t k){
+    PrePost* model = heads[k]->model.get();
+    std::vector<std::string> names = model->get_input_names();
+    std::vector<std::vector<int64_t>> shapes = model->get_input_shapes();
+    std::vector<size_t> sizes = model->get_input_sizes();
+
+    std::vector<bool> used(input_sizes.size(), false);
+    std::vector<size_t>& sources = heads[k]->sources;
+    for(size_t i = 0; i < sizes.size(); ++i){
+        size_t source = input_sizes.size();
+        for(size_t j = 0; j < input_names.size() && source == input_sizes.size(); ++j)
+            if(!used[j] && i < names.size() && input_names[j] == names[i])
+                source = j;
+        for(size_t j = 0; j < input_shapes.size() && source == input_sizes.size(); ++j)
+            if(!used[j] && i < shapes.size() && input_shapes[j] == shapes[i])
+                source = j;
+        if(source == input_sizes.size()){
+            // Nothing to share with, the head gets an input of its own
+            input_names.push_back(i < names.size() ? names[i] : std::string());
+            input_shapes.push_back(i < shapes.size() ? shapes[i] : std::vector<int64_t>());
+            input_sizes.push_back(sizes[i]);
+            used.push_back(false);
+        }
+        else if(input_sizes[source] != sizes[i]){
+            std::ostringstream oss;
+            oss << "FanOutInfer: input " << i << " of head " << k << " (" << input_names[source] << ") needs "
+                << sizes[i] << " values, an earlier head reads " << input_sizes[source] << " from it";
+            throw std::runtime_error(oss.str());
+        }
+        used[source] = true;
+        sources.push_back(source);
+    }
+}
+
+void FanOutInfer::run_head(call& c, size_t k){
+    std::exception_ptr error;
+    try{
+        std::lock_guard<std::mutex> lock(heads[k]->mutex);
+        heads[k]->model->runinference(c.inputs[k], c.outputs[k]);
+    }
+    catch(...){
+        error = std::current_exception();
+    }
+    std::lock_guard<std::mutex> lock(c.mutex);
+    if(error && !c.error)
+        c.error = error;
+    if(--c.remaining == 0)
+        c.finished.notify_all();
+}
+
+// Runs the oldest queued head, with tasks_mutex held on entry and on return
+bool FanOutInfer::run_one(std::unique_lock<std::mutex>& lock){
+    if(tasks.empty())
+        return false;
+    task t = tasks.front();
+    tasks.pop_front();
+    lock.unlock();
+    run_head(*t.c, t.head);
+    lock.lock();
+    return true;
+}
+
+void FanOutInfer::work(){
+    std::unique_lock<std::mutex> lock(tasks_mutex);
+    for(;;){
+        task_ready.wait(lock, [this](){ return stopping || !tasks.empty(); });
+        if(tasks.empty())
+            return;
+        run_one(lock);
+    }
+}
+
+void FanOutInfer::runinference(std::vector<MX::Types::FeatureMap<float>*> input, std::vector<MX::Types::FeatureMap<float>*> output){
+    call c;
+    c.inputs.resize(heads.size());
+    c.outputs.resize(heads.size());
+    for(size_t k = 0; k < heads.size(); ++k){
+        for(size_t source : heads[k]->sources)
+            c.inputs[k].push_back(input[source]);
+        c.outputs[k].assign(output.begin() + heads[k]->first_output,
+                            output.begin() + heads[k]->first_output + heads[k]->num_outputs);
+    }
+    c.remaining = heads.size();
+    {
+        std::lock_guard<std::mutex> lock(tasks_mutex);
+        for(size_t k = 1; k < heads.size(); ++k)
+            tasks.push_back(task{&c, k});
+    }
+    task_ready.notify_all();
+
+    // The calling thread takes the first head, then helps with queued ones until its call is done
+    run_head(c, 0);
+    {
+        std::unique_lock<std::mutex> lock(tasks_mutex);
+        for(;;){
+            {
+                std::lock_guard<std::mutex> call_lock(c.mutex);
+                if(c.remaining == 0)
+                    break;
+            }
+            if(!run_one(lock))
+                break;
+        }
+    }
+    std::unique_lock<std::mutex> lock(c.mutex);
+    c.finished.wait(lock, [&c](){ return c.remaining == 0; });
+    if(c.error)
+        std::rethrow_exception(c.error);
+}
+
+std::vector<std::vector<int64_t>> FanOutInfer::get_input_shapes(){
+    return input_shapes;
+}
+
+std::vector<std::vector<int64_t>> FanOutInfer::get_output_shapes(){
+    std::vector<std::vector<int64_t>> shapes;
+    for(auto& h : heads)
+        for(auto& shape : h->model->get_output_shapes())
+            shapes.push_back(shape);
+    return shapes;
+}
+
+std::vector<size_t> FanOutInfer::get_output_sizes(){
+    std::vector<size_t> sizes;
+    for(auto& h : heads)
+        for(size_t size : h->model->get_output_sizes())
+            sizes.push_back(size);
+    return sizes;
+}
+
+std::vector<size_t> FanOutInfer::get_input_sizes(){
+    return input_sizes;
+}
+
+std::vector<std::string> FanOutInfer::get_output_names(){
+    std::vector<std::string> names;
+    for(auto& h : heads)
+        for(auto& name : h->model->get_output_names())
+            names.push_back(name);
+    return names;
+}
+
+std::vector<std::string> FanOutInfer::get_input_names(){
+    return input_names;
+}
+
+size_t FanOutInfer::num_heads(){
+    return heads.size();
+}
+
+PrePost* FanOutInfer::get_head(size_t k){
+    return heads[k]->model.get();
+}
+
+FanOutInfer::~FanOutInfer(){
+    {
+        std::lock_guard<std::mutex> lock(tasks_mutex);
+        stopping = true;
+    }
+    task_ready.notify_all();
+    for(std::thread& worker : workers)
+        worker.join();
+    heads.clear();
+}
@@ -0,0 +1,88 @@
+#ifndef FANOUT_INFER
+#define FANOUT_INFER
+
+#include <memx/accl/prepost.h>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Runs several post models on the same inputs at once, as one plugin, so a
+// frame takes as long as the slowest head instead of the sum of all heads.
+// The heads read the input FeatureMaps in place, none gets its own copy.
+// Inputs of the heads are matched by name, then by shape, to the inputs of
+// the plugin; the ones that match nothing become inputs of their own. The
+// outputs are those of the first head, then the second, and so on, written
+// straight into the output FeatureMaps.
+// Each head runs one call at a time, concurrent calls overlap across heads.
+//   MX_PLUGIN_FANOUT_THREADS  threads running the heads next to the calling
+//                             thread (default number of heads - 1)
+class FanOutInfer : public PrePost{
+    private:
+        struct head{
+            std::unique_ptr<PrePost> model;
+            std::vector<size_t> sources; // input of the plugin feeding each input of the head
+            size_t first_output = 0;
+            size_t num_outputs = 0;
+            std::mutex mutex;
+        };
+        // One runinference call, on the stack of the calling thread
+        struct call{
+            std::vector<std::vector<MX::Types::FeatureMap<float>*>> inputs;
+            std::vector<std::vector<MX::Types::FeatureMap<float>*>> outputs;
+            size_t remaining;
+            std::mutex mutex;
+            std::condition_variable finished;
+            std::exception_ptr error;
+        };
+        struct task{
+            call* c;
+            size_t head;
+        };
+        std::deque<std::string> model_paths;
+        std::vector<std::unique_ptr<head>> heads;
+        std::vector<std::string> input_names;
+        std::vector<std::vector<int64_t>> input_shapes;
+        std::vector<size_t> input_sizes;
+
+        std::deque<task> tasks;
+        std::mutex tasks_mutex;
+        std::condition_variable task_ready;
+        std::vector<std::thread> workers;
+        bool stopping = false;
+
+        void init();
+        void link(size_t k);
+        void work();
+        bool run_one(std::unique_lock<std::mutex>& lock);
+        void run_head(call& c, size_t k);
+    public:
+        FanOutInfer(const char* model_paths, const std::vector<size_t>& out_sizes);
+        FanOutInfer(const std::vector<PrePost*>& models);
+        ~FanOutInfer();
+        void runinference(std::vector<MX::Types::FeatureMap<float>*> input, std::vector<MX::Types::FeatureMap<float>*> output) override;
+        std::vector<std::vector<int64_t>> get_input_shapes() override;
+        std::vector<std::vector<int64_t>> get_output_shapes() override;
+        std::vector<size_t> get_output_sizes() override;
+        std::vector<size_t> get_input_sizes() override;
+        std::vector<std::string> get_output_names() override;
+        std::vector<std::string> get_input_names() override;
+        size_t num_heads();
+        PrePost* get_head(size_t k);
+};
+
+// createFanOut takes the models separated by ';', e.g. "detect.onnx;pose.tflite",
+// and loads each with the plugin for its extension. A head with dynamic outputs takes
+// their sizes after a '|', e.g. "detect.onnx;pose.onnx|1000,2000"; out_sizes apply to
+// the last head unless it has its own.
+// createFanOutFrom fans out to plugins that were already created and takes ownership of them.
+extern "C" {
+    PrePost* createFanOut(const char* model_path, const std::vector<size_t>& out_sizes);
+    PrePost* createFanOutFrom(const std::vector<PrePost*>& models);
+}
+
+#endif
@@ -1,15 +1,84 @@
 #include "OnnxInfer.h"
+#include "async_prepost.h"
 #include <vector>
 #include <iostream>
 #include <cmath>
 #include <numeric>
 #include <thread>
 #include <chrono>
+#include <algorithm>
+#include <climits>
+#include <mutex>
 
 PrePost* createOnnx(const char* model_path, const std::vector<size_t>& out_sizes) {
     return new OnnxInfer(model_path, out_sizes);
 }
 
+void createOnnxBatch(const std::vector<std::string>& model_paths, const std::vector<std::vector<size_t>>& out_sizes, std::vector<PrePost*>& models) {
+    models = create_prepost_batch("OnnxInfer", model_paths, out_sizes, [](const char* path, const std::vector<size_t>& sizes) -> PrePost* { return new OnnxInfer(path, sizes); });
+}
+
+bool reloadOnnx(PrePost* plugin, const char* model_path, bool wait) {
+    return reload_prepost("OnnxInfer", plugin, model_path, wait);
+}
+
+// The shared pool as seen by ORT, registered once as the env allocator for CPU memory
+struct pool_ort_allocator : OrtAllocator{
+    Ort::MemoryInfo memory_info = Ort::MemoryInfo::CreateCpu(OrtAllocatorType::OrtDeviceAllocator, OrtMemType::OrtMemTypeDefault);
+    pool_ort_allocator() : OrtAllocator{} {
+        version = ORT_API_VERSION;
+        OrtAllocator::Alloc = [](OrtAllocator*, size_t size) -> void* { return plugin_pool::instance().allocate(size); };
+        OrtAllocator::Free = [](OrtAllocator*, void* p) { plugin_pool::instance().deallocate(p); };
+        OrtAllocator::Info = [](const OrtAllocator* self) -> const OrtMemoryInfo* {
+            return static_cast<const pool_ort_allocator*>(self)->memory_info;
+        };
+    }
+};
+
+static bool check_status(const char* what, OrtStatus* status){
+    if(status == nullptr)
+        return true;
+    const OrtApi& api = Ort::GetApi();
+    std::cerr << "OnnxInfer: " << what << " failed: " << api.GetErrorMessage(status) << std::endl;
+    api.ReleaseStatus(status);
+    return false;
+}
+
+// The ORT env is shared by all sessions of the process, so allocators are
+// registered on it once; false when that failed and sessions keep their own
+static bool register_pool_allocator(OrtEnv* env){
+    static std::once_flag once;
+    static bool registered = false;
+    std::call_once(once, [env](){
+        // Never destroyed, the env may still free through it at exit
+        static pool_ort_allocator* allocator = new pool_ort_allocator();
+        registered = check_status("registering the shared pool", Ort::GetApi().RegisterAllocator(env, allocator));
+    });
+    return registered;
+}
+
+// Pre-grown for the first bounded model, later ones grow it as needed
+static bool register_bounded_arena(OrtEnv* env, const Ort::MemoryInfo& info, size_t arena_bytes){
+    static std::once_flag once;
+    static bool registered = false;
+    std::call_once(once, [&](){
+        // Two frames of outputs are alive while the previous ones are released
+        Ort::ArenaCfg arena_cfg(0, 1 /* kSameAsRequested */, (int)std::min<size_t>(2 * arena_bytes, INT32_MAX), -1);
+        registered = check_status("registering the output arena", Ort::GetApi().CreateAndRegisterAllocator(env, info, arena_cfg));
+    });
+    return registered;
+}
+
+static Ort::Session* open_session(Ort::Env& env, const char* model_path, const Ort::SessionOptions& options){
+#ifndef OS_LINUX
+    std::string model_path_(model_path);
+    std::wstring widestr = std::wstring(model_path_.begin(), model_path_.end());
+    return new Ort::Session(env, widestr.c_str(), options);
+#else
+    return new Ort::Session(env, model_path, options);
+#endif
+}
+
 void OnnxInfer::init_obj(const OrtApi  g_ort, onnx_struct& onnx_obj,size_t size, Mode mode)
 {    
     onnx_obj.node_names.resize(size);
@@ -41,6 +110,8 @@ void OnnxInfer::init_obj(const OrtApi  g_ort, onnx_struct& onnx_obj,size_t size,
             g_ort.SessionGetOutputTypeInfo(*session, i, &typeinfo);
         }
         g_ort.CastTypeInfoToTensorInfo(typeinfo, &tensor_info);
+        g_ort.GetTensorElementType(tensor_info, &type);
+        onnx_obj.node_types[i] = type;
 
         // Get input shapes/dims
         size_t num_dims;
@@ -63,8 +134,13 @@ void OnnxInfer::init_obj(const OrtApi  g_ort, onnx_struct& onnx_obj,size_t size,
     }
 }
 
-OnnxInfer::OnnxInfer(const char* _model_path, const std::vector<size_t>& out_sizes): model_path{_model_path}    
+OnnxInfer::OnnxInfer(const char* _model_path, const std::vector<size_t>& out_sizes): model_path{_model_path},
+                                                                                     capture("OnnxInfer", _model_path),
+                                                                                     affinity("OnnxInfer", _model_path),
+                                                                                     budget("OnnxInfer", _model_path, 2.0, 1.0),
+                                                                                     stream(_model_path)
 {
+    plugin_affinity::scope placed(affinity);
     sessionOptions.SetGraphOptimizationLevel(GraphOptimizationLevel::ORT_ENABLE_ALL);
     sessionOptions.DisableMemPattern();
     sessionOptions.DisableCpuMemArena();
@@ -77,6 +153,9 @@ OnnxInfer::OnnxInfer(const char* _model_path, const std::vector<size_t>& out_siz
     sessionOptions.SetInterOpNumThreads(1);
     sessionOptions.SetExecutionMode(ExecutionMode::ORT_SEQUENTIAL);
     sessionOptions.SetLogSeverityLevel(OrtLoggingLevel::ORT_LOGGING_LEVEL_FATAL);
+    // Over the memory budget: no repacked copies of the weights
+    if(budget.lean())
+        sessionOptions.AddConfigEntry(kOrtSessionOptionsConfigDisablePrepacking, "1");
 
     OrtEnv* environment;
     OrtThreadingOptions* envOpts;
@@ -89,14 +168,26 @@ OnnxInfer::OnnxInfer(const char* _model_path, const std::vector<size_t>& out_siz
     g_ort.DisableTelemetryEvents(environment);
 
     env = new Ort::Env(environment);
-#ifndef OS_LINUX
-    std::string model_path_(model_path);
-    std::wstring widestr = std::wstring(model_path_.begin(), model_path_.end());
-    const wchar_t* widecstr = widestr.c_str();
-    session = new Ort::Session(*env, widecstr, sessionOptions);
-#else
-    session = new Ort::Session(*env, model_path, sessionOptions);
-#endif
+
+    if(plugin_pool::enabled() && register_pool_allocator(*env))
+        sessionOptions.AddConfigEntry(kOrtSessionOptionsConfigUseEnvAllocators, "1");
+    // Upper bounds for dynamic outputs: without the shared pool a shared arena is
+    // pre-grown for them, so bounded outputs are carved from the same memory every
+    // frame. Set before the session is built; for a model whose outputs turn out
+    // fixed the env allocator changes nothing.
+    else if(!out_sizes.empty()){
+        size_t bound_bytes = 0;
+        for(size_t bound : out_sizes)
+            bound_bytes += bound * sizeof(float);
+        if(register_bounded_arena(*env, memoryInfo, bound_bytes))
+            sessionOptions.AddConfigEntry(kOrtSessionOptionsConfigUseEnvAllocators, "1");
+    }
+
+    // Weights and activations allocated while building the session count for this model
+    pool_model = plugin_pool::instance().register_model(model_path, affinity.get_node());
+    plugin_pool::scope pool_scope(pool_model);
+    size_t resident = resident_bytes();
+    session = open_session(*env, model_path, sessionOptions);
     num_input_nodes = session->GetInputCount();
     num_output_nodes = session->GetOutputCount();
 
@@ -106,34 +197,148 @@ OnnxInfer::OnnxInfer(const char* _model_path, const std::vector<size_t>& out_siz
     if(output_struct.node_dims[0][0]<0){
         dynamic_output = true;
     }
+    half_staging.resize(num_input_nodes);
+    for(size_t i = 0; i<num_input_nodes; ++i){
+        half_inputs.push_back(input_struct.node_types[i] == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT16);
+        if(half_inputs[i])
+            half_staging[i].resize(input_struct.tensor_sizes[i]);
+    }
+    for(size_t j = 0; j<num_output_nodes; ++j)
+        half_outputs.push_back(output_struct.node_types[j] == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT16);
+    output_bounds = out_sizes;
+    if(output_bounds.size() != num_output_nodes || !dynamic_output){
+        if(!output_bounds.empty() && !dynamic_output)
+            std::cerr << "OnnxInfer: " << model_path << " has fixed-size outputs, ignoring "
+                      << output_bounds.size() << " output sizes" << std::endl;
+        else if(!output_bounds.empty())
+            std::cerr << "OnnxInfer: " << model_path << " has " << num_output_nodes << " outputs, ignoring "
+                      << output_bounds.size() << " output sizes" << std::endl;
+        output_bounds.clear();
+    }
+    footprint.weights = plugin_pool::enabled() ? plugin_pool::instance().get_usage(pool_model).bytes : resident_growth(resident);
+    if(dynamic_output && !output_bounds.empty()){
+        binding = new Ort::IoBinding(*session);
+        for(size_t j = 0; j<num_output_nodes; ++j)
+            binding->BindOutput(output_struct.node_names[j], memoryInfo);
+    }
 
     runOpts.SetRunLogSeverityLevel(ORT_LOGGING_LEVEL_FATAL);
     runOpts.SetRunLogVerbosityLevel(ORT_LOGGING_LEVEL_FATAL);
+
+    // Inputs are fed from the FeatureMaps and outputs come from the arena, only fp16 inputs are staged
+    for(size_t i = 0; i<num_input_nodes; ++i)
+        footprint.io += half_staging[i].size() * sizeof(uint16_t);
+    budget.commit(get_footprint());
+
+    warmup.start("OnnxInfer", model_path, [this](){ warmup_once(); });
+}
+
+void OnnxInfer::warmup_once(){
+    plugin_pool::scope pool_scope(pool_model);
+    if(warmup_tensors.empty()){
+        warmup_data.resize(num_input_nodes);
+        warmup_dims.resize(num_input_nodes);
+        for (size_t i = 0; i < num_input_nodes; i++)
+        {
+            size_t size = half_inputs[i] ? sizeof(uint16_t) : sizeof(float);
+            for(int64_t dim : input_struct.node_dims[i]){
+                warmup_dims[i].push_back(dim > 0 ? dim : 1);
+                size *= warmup_dims[i].back();
+            }
+            warmup_data[i].assign(size, 0); // zero in both widths, also pre-faults the buffer
+            warmup_tensors.emplace_back(Ort::Value::CreateTensor(
+                memoryInfo, warmup_data[i].data(), size, warmup_dims[i].data(), warmup_dims[i].size(),
+                input_struct.node_types[i]));
+        }
+    }
+    // Outputs come from the same allocator as real runs and are released right away
+    session->Run(runOpts,
+                input_struct.node_names.data(), warmup_tensors.data(), num_input_nodes,
+                output_struct.node_names.data(), num_output_nodes);
 }
 
 void OnnxInfer::runinference(std::vector<MX::Types::FeatureMap<float>*> input, std::vector<MX::Types::FeatureMap<float>*> output){
+    stream.run(output, [this](){ return get_output_sizes(); }, [&](){ infer(input, output); });
+}
 
+void OnnxInfer::infer(std::vector<MX::Types::FeatureMap<float>*>& input, std::vector<MX::Types::FeatureMap<float>*>& output){
+    warmup.wait();
+    plugin_capture::call captured(capture, input, input_struct.tensor_sizes, input_struct.node_dims);
+    if(reuse.lookup(input, input_struct.tensor_sizes, output))
+        return;
+    plugin_pool::scope pool_scope(pool_model);
+    inputTensors.clear();
     for (size_t i = 0; i < num_input_nodes; i++)
     {
+        if(half_inputs[i]){
+            float_to_half(input[i]->get_data_ptr(), half_staging[i].data(), half_staging[i].size());
+            inputTensors.emplace_back(Ort::Value::CreateTensor(
+                memoryInfo, half_staging[i].data(), half_staging[i].size() * sizeof(uint16_t),
+                input_struct.node_dims[i].data(), input_struct.node_dims[i].size(), ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT16));
+            continue;
+        }
         inputTensors.emplace_back(Ort::Value::CreateTensor<float>(
             memoryInfo, input[i]->get_data_ptr(), (input_struct.tensor_sizes[i]), 
             input_struct.node_dims[i].data(), input_struct.node_dims[i].size()));
     }   
 
+    if(binding){
+        run_bounded(output);
+        reuse.store(input, input_struct.tensor_sizes, output, output_struct.tensor_sizes, true);
+        return;
+    }
+
     outputTensors = session->Run(runOpts, 
                 input_struct.node_names.data(), inputTensors.data(), num_input_nodes, 
                 output_struct.node_names.data(), num_output_nodes);
     for(size_t j = 0; j<num_output_nodes; ++j){
         if(dynamic_output){ 
-            output_struct.tensor_sizes[j] =  outputTensors[j].GetTensorTypeAndShapeInfo().GetElementCount();
-            output_struct.node_dims[j] = outputTensors[j].GetTensorTypeAndShapeInfo().GetShape();
+            Ort::TensorTypeAndShapeInfo info = outputTensors[j].GetTensorTypeAndShapeInfo();
+            output_struct.tensor_sizes[j] = info.GetElementCount();
+            output_struct.node_dims[j] = info.GetShape();
             if(output_struct.tensor_sizes[j]>0)
-            memcpy(output[j]->get_data_ptr(),outputTensors[j].GetTensorData<float>(),sizeof(float)*output_struct.tensor_sizes[j]);
+            copy_output(j, output[j]->get_data_ptr(), output_struct.tensor_sizes[j]);
+        }
+        else if(half_outputs[j]){
+            copy_output(j, output[j]->get_data_ptr(), output_struct.tensor_sizes[j]);
         }
         else{
             output[j]->set_data(outputTensors[j].GetTensorMutableData<float>());
         }
     }
+    reuse.store(input, input_struct.tensor_sizes, output, output_struct.tensor_sizes, dynamic_output);
+}
+
+void OnnxInfer::copy_output(size_t j, float* dst, size_t count){
+    if(half_outputs[j])
+        half_to_float(static_cast<const uint16_t*>(outputTensors[j].GetTensorRawData()), dst, count);
+    else
+        memcpy(dst, outputTensors[j].GetTensorData<float>(), sizeof(float)*count);
+}
+
+void OnnxInfer::run_bounded(std::vector<MX::Types::FeatureMap<float>*>& output){
+    for (size_t i = 0; i < num_input_nodes; i++)
+        binding->BindInput(input_struct.node_names[i], inputTensors[i]);
+
+    outputTensors.clear(); // hand the previous outputs back to the arena first
+    session->Run(runOpts, *binding);
+    outputTensors = binding->GetOutputValues();
+
+    for(size_t j = 0; j<num_output_nodes; ++j){
+        Ort::TensorTypeAndShapeInfo info = outputTensors[j].GetTensorTypeAndShapeInfo();
+        std::vector<int64_t> shape = info.GetShape();
+        size_t count = info.GetElementCount();
+        if(count > output_bounds[j] && !shape.empty() && shape[0] > 0){
+            // More results than the FeatureMap holds: keep the leading rows that fit
+            size_t row = count / shape[0];
+            shape[0] = row ? output_bounds[j] / row : 0;
+            count = shape[0] * row;
+        }
+        output_struct.node_dims[j] = shape;
+        output_struct.tensor_sizes[j] = count;
+        if(count>0)
+        copy_output(j, output[j]->get_data_ptr(), count);
+    }
 }
 
 // void OnnxInfer::runinference(std::vector<MX::Types::FeatureMap<uint8_t>*> input, std::vector<MX::Types::FeatureMap<uint8_t>*> output){
@@ -167,6 +372,9 @@ std::vector<std::vector<int64_t>> OnnxInfer::get_input_shapes(){
 }
 
 std::vector<size_t> OnnxInfer::get_output_sizes(){
+    // Bounded outputs: FeatureMaps are sized for the largest result
+    if(binding)
+        return output_bounds;
     return output_struct.tensor_sizes;
 }
 
@@ -181,6 +389,36 @@ std::vector<std::string> OnnxInfer::get_input_names(){
     return in_names;
 }
 
+double OnnxInfer::get_warmup_ms(){
+    return warmup.elapsed_ms();
+}
+
+size_t OnnxInfer::get_pool_bytes(){
+    return plugin_pool::instance().get_usage(pool_model).bytes;
+}
+
+plugin_scheduler::stream_stats OnnxInfer::get_stream_stats(){
+    return stream.get_stats();
+}
+
+// Weights are what the session took while being built, the pool growth since is its arena
+plugin_footprint OnnxInfer::get_footprint(){
+    plugin_footprint current = footprint;
+    if(plugin_pool::enabled()){
+        size_t pooled = plugin_pool::instance().get_usage(pool_model).bytes;
+        current.arena = pooled > footprint.weights ? pooled - footprint.weights : 0;
+    }
+    return current;
+}
+
+uint64_t OnnxInfer::get_reuse_hits(){
+    return reuse.get_hits();
+}
+
+uint64_t OnnxInfer::get_reuse_misses(){
+    return reuse.get_misses();
+}
+
 std::vector<std::string> OnnxInfer::get_output_names(){
     std::vector<std::string> out_names;
     for(int i = 0; i<num_output_nodes; ++i)
@@ -189,9 +427,13 @@ std::vector<std::string> OnnxInfer::get_output_names(){
 }
 
 OnnxInfer::~OnnxInfer(){
+    warmup.finish();
+    warmup_tensors.clear();
     for(int i = 0; i<num_input_nodes; ++i)
     free(input_struct.node_names[i]);
     for(int i = 0; i<num_output_nodes; ++i)
     free(output_struct.node_names[i]);
+    outputTensors.clear();
+    delete binding;
     delete session;
 }
\ No newline at end of file
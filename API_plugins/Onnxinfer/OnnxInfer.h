@@ -10,6 +10,14 @@
 #include <iostream>
 #include <memx/accl/prepost.h>
 #include <thread>
+#include "plugin_warmup.h"
+#include "plugin_pool.h"
+#include "plugin_fp16.h"
+#include "plugin_reuse.h"
+#include "plugin_capture.h"
+#include "plugin_affinity.h"
+#include "plugin_footprint.h"
+#include "plugin_scheduler.h"
 
 typedef struct{
     std::vector<char* > node_names;
@@ -42,6 +50,33 @@ class OnnxInfer : public PrePost{
         void init_obj(const OrtApi g_ort, onnx_struct& onnx_obj,size_t size, Mode mode);
         std::vector<Ort::Value> inputTensors;
         std::vector<Ort::Value> outputTensors;
+
+        // Bounded dynamic outputs: out_sizes gives the max element count of each output,
+        // ORT writes them into a pre-grown arena through IoBinding
+        std::vector<size_t> output_bounds;
+        Ort::IoBinding* binding = nullptr;
+        void run_bounded(std::vector<MX::Types::FeatureMap<float>*>& output);
+
+        // fp16 models run natively, FeatureMaps are converted at the boundary
+        std::vector<bool> half_inputs;
+        std::vector<bool> half_outputs;
+        std::vector<std::vector<uint16_t>> half_staging;
+        void copy_output(size_t j, float* dst, size_t count);
+
+        // Zero inputs for the warm-up runs, dynamic dimensions set to 1
+        std::vector<std::vector<uint8_t>> warmup_data;
+        std::vector<std::vector<int64_t>> warmup_dims;
+        std::vector<Ort::Value> warmup_tensors;
+        void warmup_once();
+        plugin_warmup warmup;
+        plugin_reuse reuse;
+        plugin_capture capture;
+        plugin_affinity affinity;
+        plugin_budget::ticket budget;
+        plugin_footprint footprint;
+        plugin_stream stream;
+        void infer(std::vector<MX::Types::FeatureMap<float>*>& input, std::vector<MX::Types::FeatureMap<float>*>& output);
+        int pool_model = -1;
         std::thread infer_thread;
     public:
         ~OnnxInfer();
@@ -54,13 +89,26 @@ class OnnxInfer : public PrePost{
         std::vector<size_t> get_input_sizes() override;
         std::vector<std::string> get_output_names() override;
         std::vector<std::string> get_input_names() override;
+        double get_warmup_ms();
+        size_t get_pool_bytes();
+        plugin_footprint get_footprint();
+        plugin_scheduler::stream_stats get_stream_stats();
+        uint64_t get_reuse_hits();
+        uint64_t get_reuse_misses();
 };
 
+// createOnnxBatch builds all models on a loader pool at once and returns
+// when every one is ready, with one handle per path in the same order.
+// reloadOnnx swaps a new model into such a handle between two calls.
 #ifndef OS_LINUX
 extern "C" __declspec(dllexport) PrePost * createOnnx(const char* model_path, const std::vector<size_t>&out_sizes);
+extern "C" __declspec(dllexport) void createOnnxBatch(const std::vector<std::string>&model_paths, const std::vector<std::vector<size_t>>&out_sizes, std::vector<PrePost*>&models);
+extern "C" __declspec(dllexport) bool reloadOnnx(PrePost * plugin, const char* model_path, bool wait);
 #else
 extern "C" {
     PrePost* createOnnx(const char* model_path, const std::vector<size_t>& out_sizes);
+    void createOnnxBatch(const std::vector<std::string>& model_paths, const std::vector<std::vector<size_t>>& out_sizes, std::vector<PrePost*>& models);
+    bool reloadOnnx(PrePost* plugin, const char* model_path, bool wait);
 }
 #endif
 
@@ -0,0 +1,321 @@
+// Replays a capture written with MX_PLUGIN_CAPTURE through a pre/post plugin.
+//
+// Loads the plugin library the way MxAccl does, feeds the captured inputs to
+// runinference at the original pace or back to back, and reports the per-call
+// timing next to the timing recorded while capturing.
+//
+// Usage: mxplugin_replay --capture FILE [--model PATH] [--lib LIB --factory NAME]
+//                        [--rate original|max] [--repeat N] [--out-sizes N,N,...] [--csv FILE]
+//
+// The plugin and model default to the ones named in the capture.
+
+#include "plugin_capture.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+typedef PrePost* (*plugin_factory)(const char* model_path, const std::vector<size_t>& out_sizes);
+
+struct replay_config{
+    std::string capture;
+    std::string model;
+    std::string lib;
+    std::string factory;
+    bool original_rate = true;
+    int repeat = 1;
+    std::vector<size_t> out_sizes;
+    std::string csv;
+};
+
+struct captured_input{
+    std::vector<int64_t> dims;
+    const float* data;
+    size_t count;
+};
+
+struct captured_call{
+    uint64_t timestamp_ns;
+    uint64_t duration_ns;
+    std::vector<captured_input> inputs;
+};
+
+static void usage(const char* prog){
+    printf("Usage: %s --capture FILE [--model PATH] [--lib LIB --factory NAME] [--rate original|max] "
+           "[--repeat N] [--out-sizes N,N,...] [--csv FILE]\n", prog);
+}
+
+static bool parse_args(int argc, char* argv[], replay_config& cfg){
+    for(int i = 1; i < argc; i++){
+        std::string arg = argv[i];
+        if(i + 1 >= argc)
+            return false;
+        std::string val = argv[++i];
+        if(arg == "--capture")
+            cfg.capture = val;
+        else if(arg == "--model")
+            cfg.model = val;
+        else if(arg == "--lib")
+            cfg.lib = val;
+        else if(arg == "--factory")
+            cfg.factory = val;
+        else if(arg == "--rate"){
+            if(val != "original" && val != "max")
+                return false;
+            cfg.original_rate = (val == "original");
+        }
+        else if(arg == "--repeat")
+            cfg.repeat = atoi(val.c_str());
+        else if(arg == "--out-sizes"){
+            std::stringstream ss(val);
+            std::string size;
+            while(std::getline(ss, size, ','))
+                cfg.out_sizes.push_back(strtoull(size.c_str(), nullptr, 10));
+        }
+        else if(arg == "--csv")
+            cfg.csv = val;
+        else
+            return false;
+    }
+    return !cfg.capture.empty() && cfg.repeat > 0;
+}
+
+// Library and factory MxAccl would use for the plugin that wrote the capture
+static bool default_plugin(const std::string& plugin, replay_config& cfg){
+    const char* lib = nullptr;
+    const char* factory = nullptr;
+    if(plugin == "OnnxInfer"){
+        lib = "libonnxinfer.so";
+        factory = "createOnnx";
+    }
+    else if(plugin == "TfInfer"){
+        lib = "libtfinfer.so";
+        factory = "createTf";
+    }
+    else if(plugin == "TfliteInfer"){
+        lib = "libtfliteinfer.so";
+        factory = "createTflite";
+    }
+    else
+        return false;
+    if(cfg.lib.empty())
+        cfg.lib = lib;
+    if(cfg.factory.empty())
+        cfg.factory = factory;
+    return true;
+}
+
+// Every length in the file is checked against the mapping, so a truncated or
+// corrupt capture ends the stream instead of reading past it
+static bool read_capture(const char* data, size_t size, std::string& plugin, std::string& model, std::vector<captured_call>& calls){
+    capture_file_header header;
+    if(size < sizeof(header))
+        return false;
+    memcpy(&header, data, sizeof(header));
+    if(memcmp(header.magic, capture_file_magic, sizeof(header.magic)) != 0 || header.version != capture_version)
+        return false;
+    size_t names = (size_t)header.plugin_length + header.model_length;
+    if(names > size - sizeof(header) || header.header_bytes < sizeof(header) + names || header.header_bytes > size)
+        return false;
+    plugin.assign(data + sizeof(header), header.plugin_length);
+    model.assign(data + sizeof(header) + header.plugin_length, header.model_length);
+
+    size_t offset = header.header_bytes;
+    while(size - offset >= sizeof(capture_record)){
+        const capture_record* record = reinterpret_cast<const capture_record*>(data + offset);
+        if(record->magic != capture_record_magic)
+            break;
+        if(record->bytes < sizeof(capture_record) || record->bytes > size - offset){
+            fprintf(stderr, "record at offset %zu is corrupt, ignoring the rest of the capture\n", offset);
+            break;
+        }
+        captured_call call;
+        call.timestamp_ns = record->timestamp_ns;
+        call.duration_ns = record->duration_ns;
+        const char* p = data + offset + sizeof(capture_record);
+        const char* end = data + offset + record->bytes;
+        bool valid = true;
+        for(uint32_t i = 0; i < record->num_inputs; ++i){
+            if((size_t)(end - p) < sizeof(capture_input)){
+                valid = false;
+                break;
+            }
+            const capture_input* in = reinterpret_cast<const capture_input*>(p);
+            p += sizeof(capture_input);
+            if(in->ndims > (size_t)(end - p) / sizeof(int64_t)){
+                valid = false;
+                break;
+            }
+            captured_input input;
+            input.dims.resize(in->ndims);
+            memcpy(input.dims.data(), p, in->ndims * sizeof(int64_t));
+            p += in->ndims * sizeof(int64_t);
+            if(in->count > (size_t)(end - p) / sizeof(float) || capture_align(in->count * sizeof(float)) > (size_t)(end - p)){
+                valid = false;
+                break;
+            }
+            input.data = reinterpret_cast<const float*>(p);
+            input.count = in->count;
+            p += capture_align(in->count * sizeof(float));
+            call.inputs.push_back(input);
+        }
+        if(!valid){
+            fprintf(stderr, "record at offset %zu is corrupt, ignoring the rest of the capture\n", offset);
+            break;
+        }
+        calls.push_back(call);
+        offset += record->bytes;
+    }
+    return true;
+}
+
+// FeatureMaps like the ones MxAccl hands to the plugins: flat float buffers of a given size
+static std::unique_ptr<MX::Types::FeatureMap<float>> make_featuremap(size_t count){
+    return std::unique_ptr<MX::Types::FeatureMap<float>>(new MX::Types::FeatureMap<float>(count));
+}
+
+static double percentile(std::vector<double> values, double p){
+    if(values.empty())
+        return 0;
+    std::sort(values.begin(), values.end());
+    size_t index = std::min(values.size() - 1, (size_t)(p / 100.0 * (values.size() - 1) + 0.5));
+    return values[index];
+}
+
+static void report(const char* label, const std::vector<double>& us){
+    if(us.empty()){
+        printf("%-9s no timed calls\n", label);
+        return;
+    }
+    double sum = 0;
+    for(double v : us)
+        sum += v;
+    printf("%-9s calls %6zu  mean %9.1f us  p50 %9.1f us  p90 %9.1f us  p99 %9.1f us  max %9.1f us\n",
+           label, us.size(), sum / us.size(), percentile(us, 50), percentile(us, 90), percentile(us, 99), percentile(us, 100));
+}
+
+int main(int argc, char* argv[]){
+    replay_config cfg;
+    if(!parse_args(argc, argv, cfg)){
+        usage(argv[0]);
+        return 1;
+    }
+
+    int fd = open(cfg.capture.c_str(), O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0){
+        fprintf(stderr, "couldn't open %s\n", cfg.capture.c_str());
+        return 1;
+    }
+    const char* mapped = static_cast<const char*>(mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0));
+    if(mapped == MAP_FAILED){
+        fprintf(stderr, "couldn't map %s\n", cfg.capture.c_str());
+        return 1;
+    }
+
+    std::string plugin, captured_model;
+    std::vector<captured_call> calls;
+    if(!read_capture(mapped, st.st_size, plugin, captured_model, calls)){
+        fprintf(stderr, "%s is not a plugin capture\n", cfg.capture.c_str());
+        return 1;
+    }
+    if(calls.empty()){
+        fprintf(stderr, "%s holds no calls\n", cfg.capture.c_str());
+        return 1;
+    }
+    if(cfg.model.empty())
+        cfg.model = captured_model;
+    if((cfg.lib.empty() || cfg.factory.empty()) && !default_plugin(plugin, cfg)){
+        fprintf(stderr, "unknown plugin %s, pass --lib and --factory\n", plugin.c_str());
+        return 1;
+    }
+
+    void* lib = dlopen(cfg.lib.c_str(), RTLD_NOW);
+    if(lib == nullptr){
+        fprintf(stderr, "couldn't load %s: %s\n", cfg.lib.c_str(), dlerror());
+        return 1;
+    }
+    plugin_factory create = reinterpret_cast<plugin_factory>(dlsym(lib, cfg.factory.c_str()));
+    if(create == nullptr){
+        fprintf(stderr, "%s has no %s\n", cfg.lib.c_str(), cfg.factory.c_str());
+        return 1;
+    }
+    std::unique_ptr<PrePost> model(create(cfg.model.c_str(), cfg.out_sizes));
+
+    std::vector<std::unique_ptr<MX::Types::FeatureMap<float>>> input_maps, output_maps;
+    std::vector<MX::Types::FeatureMap<float>*> inputs, outputs;
+    // Big enough for the largest input of every call, captures may change size between frames
+    std::vector<size_t> input_counts(calls[0].inputs.size(), 0);
+    for(const captured_call& call : calls)
+        if(call.inputs.size() == input_counts.size())
+            for(size_t i = 0; i < input_counts.size(); ++i)
+                input_counts[i] = std::max(input_counts[i], call.inputs[i].count);
+    for(size_t count : input_counts){
+        input_maps.push_back(make_featuremap(count));
+        inputs.push_back(input_maps.back().get());
+    }
+    for(size_t size : model->get_output_sizes()){
+        output_maps.push_back(make_featuremap(size));
+        outputs.push_back(output_maps.back().get());
+    }
+
+    printf("replaying %zu calls of %s through %s (%s), %s rate, %d pass(es)\n", calls.size(), cfg.model.c_str(),
+           cfg.lib.c_str(), plugin.c_str(), cfg.original_rate ? "original" : "max", cfg.repeat);
+
+    FILE* csv = cfg.csv.empty() ? nullptr : fopen(cfg.csv.c_str(), "w");
+    if(csv)
+        fprintf(csv, "pass,call,timestamp_ns,captured_ns,replay_ns\n");
+
+    std::vector<double> captured_us, replay_us;
+    for(const captured_call& call : calls)
+        if(call.duration_ns > 0)
+            captured_us.push_back(call.duration_ns / 1e3);
+
+    auto replay_start = std::chrono::steady_clock::now();
+    for(int pass = 0; pass < cfg.repeat; ++pass){
+        auto pass_start = std::chrono::steady_clock::now();
+        for(size_t c = 0; c < calls.size(); ++c){
+            const captured_call& call = calls[c];
+            if(call.inputs.size() != inputs.size()){
+                fprintf(stderr, "call %zu has %zu inputs, expected %zu, skipped\n", c, call.inputs.size(), inputs.size());
+                continue;
+            }
+            for(size_t i = 0; i < inputs.size(); ++i)
+                memcpy(inputs[i]->get_data_ptr(), call.inputs[i].data, call.inputs[i].count * sizeof(float));
+            if(cfg.original_rate)
+                std::this_thread::sleep_until(pass_start + std::chrono::nanoseconds(call.timestamp_ns - calls[0].timestamp_ns));
+
+            auto begin = std::chrono::steady_clock::now();
+            model->runinference(inputs, outputs);
+            double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count();
+            replay_us.push_back(us);
+            if(csv)
+                fprintf(csv, "%d,%zu,%llu,%llu,%.0f\n", pass, c, (unsigned long long)call.timestamp_ns,
+                        (unsigned long long)call.duration_ns, us * 1e3);
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - replay_start).count();
+
+    report("captured", captured_us);
+    report("replay", replay_us);
+    printf("throughput %.1f calls/s\n", replay_us.size() / seconds);
+
+    if(csv)
+        fclose(csv);
+    model.reset();
+    munmap(const_cast<char*>(mapped), st.st_size);
+    close(fd);
+    return 0;
+}
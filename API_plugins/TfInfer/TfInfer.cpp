@@ -1,10 +1,39 @@
 #include "TfInfer.h"
+#include "plugin_options.h"
+#include "async_prepost.h"
+#include <tensorflow/core/framework/allocation_description.pb.h>
+#include <tensorflow/core/framework/tensor.h>
 #include <unordered_map>
 
+namespace {
+// Tensor memory owned by someone else, here a FeatureMap of the caller
+class ExternalBuffer : public tensorflow::TensorBuffer {
+    public:
+        ExternalBuffer(void* data, size_t len) : tensorflow::TensorBuffer(data), len_(len) {}
+        size_t size() const override { return len_; }
+        tensorflow::TensorBuffer* root_buffer() override { return this; }
+        void FillAllocationDescription(tensorflow::AllocationDescription* proto) const override {
+            proto->set_requested_bytes(len_);
+            proto->set_allocator_name("featuremap");
+        }
+        bool OwnsMemory() const override { return false; }
+    private:
+        size_t len_;
+};
+}
+
 PrePost* createTf(const char* model_path, const std::vector<size_t>& out_sizes) {
     return new TfInfer(model_path,out_sizes);
 }
 
+void createTfBatch(const std::vector<std::string>& model_paths, const std::vector<std::vector<size_t>>& out_sizes, std::vector<PrePost*>& models) {
+    models = create_prepost_batch("TfInfer", model_paths, out_sizes, [](const char* path, const std::vector<size_t>& sizes) -> PrePost* { return new TfInfer(path, sizes); });
+}
+
+bool reloadTf(PrePost* plugin, const char* model_path, bool wait) {
+    return reload_prepost("TfInfer", plugin, model_path, wait);
+}
+
 void TfInfer::LoadGraph() {
     tensorflow::SessionOptions options; 
     tensorflow::RunOptions run_opts;
@@ -13,17 +42,32 @@ void TfInfer::LoadGraph() {
         printf("couldn't load the graph\n");
         return;
     }
-    session.reset(tensorflow::NewSession(tensorflow::SessionOptions()));
+    if(affinity.active()){
+        // Own thread pools, started on the instance's CPUs, instead of the process-wide ones
+        int cpus = (int)affinity.get_placement().cpus.size();
+        options.config.set_use_per_session_threads(true);
+        options.config.set_intra_op_parallelism_threads(cpus);
+        options.config.set_inter_op_parallelism_threads(cpus);
+    }
+    session.reset(tensorflow::NewSession(options));
     auto session_create_status = session->Create(graph_def);
     if (!session_create_status.ok()) {
         printf("couldn't create session\n");
     }
+    // The session keeps its own copy of the graph, the constants in it become tensors on the first run
+    footprint.graph = graph_def.SpaceUsedLong();
+    footprint.weights = file_bytes(model_path_);
 }
 
 TfInfer::TfInfer(const char* model_path, const std::vector<size_t>& out_sizes) : 
                     model_path_{model_path},
-                    output_sizes_def{out_sizes}
+                    output_sizes_def{out_sizes},
+                    capture("TfInfer", model_path),
+                    affinity("TfInfer", model_path),
+                    budget("TfInfer", model_path, 3.0, 3.0),
+                    stream(model_path)
 {
+    plugin_affinity::scope placed(affinity);
     LoadGraph();
     graph_size = graph_def.node_size();
     for(size_t i =0; i< graph_size; ++i){
@@ -31,6 +75,26 @@ TfInfer::TfInfer(const char* model_path, const std::vector<size_t>& out_sizes) :
         node_map[node.name()] = node;
     }
     record_tensor_details();    
+    // Only needed to find the inputs and outputs, they hold a few copies of every constant
+    tensorflow::GraphDef().Swap(&graph_def);
+    std::unordered_map<std::string, tensorflow::NodeDef>().swap(node_map);
+    std::unordered_map<std::string, std::vector<tensorflow::NodeDef>>().swap(outbound_node_map);
+
+    zero_copy_inputs = plugin_option_bool("MX_PLUGIN_ZERO_COPY", true);
+    model_feeds = model_inputs;
+    fed_inputs.assign(num_inputs, nullptr);
+
+    for(auto& model_input : model_inputs){
+        prefault(model_input.second.data(), model_input.second.TotalBytes());
+        footprint.io += model_input.second.TotalBytes();
+    }
+    for(size_t size : output_sizes)
+        footprint.io += size * sizeof(float);
+    budget.commit(footprint);
+    warmup.start("TfInfer", model_path_, [this](){
+        std::vector<tensorflow::Tensor> warmup_outputs;
+        session->Run(model_inputs, output_names, {}, &warmup_outputs);
+    });
 }
 
 std::vector<tensorflow::NodeDef> TfInfer::inbound(tensorflow::NodeDef& node){
@@ -56,7 +120,10 @@ void TfInfer::record_tensor_details(){
             input_shapes.push_back(cur_shapes);
             input_sizes.push_back(static_cast<size_t>(shape.num_elements()));
             num_inputs++;
-            tensorflow::Tensor input_tensor(tensorflow::DT_FLOAT,shape);
+            auto dtype = node.attr().find("dtype");
+            bool half = dtype != node.attr().end() && dtype->second.type() == tensorflow::DT_HALF;
+            half_inputs.push_back(half);
+            tensorflow::Tensor input_tensor(half ? tensorflow::DT_HALF : tensorflow::DT_FLOAT,shape);
             model_inputs.push_back({node.name(), input_tensor});
         }
     }
@@ -109,15 +176,48 @@ void TfInfer::record_tensor_details(){
 }
 
 void TfInfer::runinference(std::vector<MX::Types::FeatureMap<float>*> inputs, std::vector<MX::Types::FeatureMap<float>*> outputs){
+    stream.run(outputs, [this](){ return output_sizes; }, [&](){ infer(inputs, outputs); });
+}
+
+void TfInfer::infer(std::vector<MX::Types::FeatureMap<float>*>& inputs, std::vector<MX::Types::FeatureMap<float>*>& outputs){
+    warmup.wait();
+    plugin_capture::call captured(capture, inputs, input_sizes, input_shapes);
+    if(reuse.lookup(inputs, input_sizes, outputs))
+        return;
     for(int i =0; i<num_inputs;++i ){
-        inputs[i]->get_data((float*)model_inputs[i].second.data());
+        float* data = inputs[i]->get_data_ptr();
+        if(half_inputs[i]){
+            float_to_half(data, reinterpret_cast<uint16_t*>(model_inputs[i].second.data()), input_sizes[i]);
+            model_feeds[i].second = model_inputs[i].second;
+            continue;
+        }
+        // Eigen kernels CHECK the alignment of every tensor they map
+        if(zero_copy_inputs && reinterpret_cast<uintptr_t>(data) % EIGEN_MAX_ALIGN_BYTES == 0){
+            if(data != fed_inputs[i]){
+                const tensorflow::Tensor& owned = model_inputs[i].second;
+                ExternalBuffer* buffer = new ExternalBuffer(data, owned.TotalBytes());
+                model_feeds[i].second = tensorflow::Tensor(tensorflow::DT_FLOAT, owned.shape(), buffer);
+                buffer->Unref();
+                fed_inputs[i] = data;
+            }
+        }
+        else{
+            inputs[i]->get_data((float*)model_inputs[i].second.data());
+            model_feeds[i].second = model_inputs[i].second;
+            fed_inputs[i] = nullptr;
+        }
     }
     
-    tensorflow::Status run_status = session->Run(model_inputs, output_names, {}, &model_outputs);
+    tensorflow::Status run_status = session->Run(model_feeds, output_names, {}, &model_outputs);
 
     for(int i =0; i<num_outputs;++i ){
+        if(model_outputs[i].dtype() == tensorflow::DT_HALF){
+            half_to_float(reinterpret_cast<const uint16_t*>(model_outputs[i].data()), outputs[i]->get_data_ptr(), model_outputs[i].NumElements());
+            continue;
+        }
         outputs[i]->set_data((float*)model_outputs[i].data());
     }
+    reuse.store(inputs, input_sizes, outputs, output_sizes, false);
 }
 
 void TfInfer::runinference(std::vector<MX::Types::FeatureMap<uint8_t>*> input, std::vector<MX::Types::FeatureMap<uint8_t>*> output){}
@@ -143,6 +243,27 @@ std::vector<std::string> TfInfer::get_output_names() {
     return output_names;
 }
 
+double TfInfer::get_warmup_ms() {
+    return warmup.elapsed_ms();
+}
+
+// TF's allocator isn't observable from here, its working memory is not included
+plugin_scheduler::stream_stats TfInfer::get_stream_stats(){
+    return stream.get_stats();
+}
+
+plugin_footprint TfInfer::get_footprint() {
+    return footprint;
+}
+
+uint64_t TfInfer::get_reuse_hits() {
+    return reuse.get_hits();
+}
+
+uint64_t TfInfer::get_reuse_misses() {
+    return reuse.get_misses();
+}
+
 // void TfInfer::record_tensor_details(){
 //     const auto& signature_def_map = bundle.GetSignatures();
 //     const auto& signature_def = signature_def_map.at("serving_default");
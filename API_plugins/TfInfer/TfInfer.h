@@ -4,6 +4,13 @@
 #include <string.h>
 #include <memx/accl/prepost.h>
 #include <tensorflow/core/public/session.h>
+#include "plugin_warmup.h"
+#include "plugin_fp16.h"
+#include "plugin_reuse.h"
+#include "plugin_capture.h"
+#include "plugin_affinity.h"
+#include "plugin_footprint.h"
+#include "plugin_scheduler.h"
 
 class TfInfer : public PrePost{
     private:
@@ -29,8 +36,22 @@ class TfInfer : public PrePost{
         std::unordered_map<std::string, std::vector<tensorflow::NodeDef>> outbound_node_map;
         std::vector<std::pair<std::string, tensorflow::Tensor> > model_inputs;
         std::vector<tensorflow::Tensor> model_outputs;
+        // Zero-copy feeds: tensors wrapping the input FeatureMap memory
+        bool zero_copy_inputs;
+        std::vector<std::pair<std::string, tensorflow::Tensor> > model_feeds;
+        std::vector<float*> fed_inputs;
+        // DT_HALF placeholders get the FeatureMaps converted instead
+        std::vector<bool> half_inputs;
+        plugin_warmup warmup;
+        plugin_reuse reuse;
+        plugin_capture capture;
+        plugin_affinity affinity;
+        plugin_budget::ticket budget;
+        plugin_footprint footprint;
+        plugin_stream stream;
+        void infer(std::vector<MX::Types::FeatureMap<float>*>& input, std::vector<MX::Types::FeatureMap<float>*>& output);
     public:
-        ~TfInfer(){};
+        ~TfInfer(){ warmup.finish(); };
         TfInfer(const char* model_path, const std::vector<size_t>& out_sizes);
         void runinference(std::vector<MX::Types::FeatureMap<float>*> input, std::vector<MX::Types::FeatureMap<float>*> output) override ;
         std::vector<std::vector<int64_t>> get_input_shapes() override;
@@ -40,10 +61,20 @@ class TfInfer : public PrePost{
         std::vector<size_t> get_input_sizes() override;
         std::vector<std::string> get_output_names() override;
         std::vector<std::string> get_input_names() override;
+        double get_warmup_ms();
+        plugin_footprint get_footprint();
+        plugin_scheduler::stream_stats get_stream_stats();
+        uint64_t get_reuse_hits();
+        uint64_t get_reuse_misses();
 };
 
+// createTfBatch builds all models on a loader pool at once and returns
+// when every one is ready, with one handle per path in the same order.
+// reloadTf swaps a new model into such a handle between two calls.
 extern "C" {
     PrePost* createTf(const char* model_path, const std::vector<size_t>& out_sizes);
+    void createTfBatch(const std::vector<std::string>& model_paths, const std::vector<std::vector<size_t>>& out_sizes, std::vector<PrePost*>& models);
+    bool reloadTf(PrePost* plugin, const char* model_path, bool wait);
 }
 
 #endif
@@ -1,12 +1,29 @@
 #include "TfliteInfer.h"
+#include "plugin_options.h"
+#include "async_prepost.h"
 #include <tensorflow/lite/logger.h>
+#include <tensorflow/lite/util.h>
 
 PrePost* createTflite(const char* model_path, const std::vector<size_t>& out_sizes) {
     return new TfliteInfer(model_path,out_sizes);
 }
 
-TfliteInfer::TfliteInfer(const char* model_path, const std::vector<size_t>& out_sizes): model_path_{model_path}
+void createTfliteBatch(const std::vector<std::string>& model_paths, const std::vector<std::vector<size_t>>& out_sizes, std::vector<PrePost*>& models) {
+    models = create_prepost_batch("TfliteInfer", model_paths, out_sizes, [](const char* path, const std::vector<size_t>& sizes) -> PrePost* { return new TfliteInfer(path, sizes); });
+}
+
+bool reloadTflite(PrePost* plugin, const char* model_path, bool wait) {
+    return reload_prepost("TfliteInfer", plugin, model_path, wait);
+}
+
+TfliteInfer::TfliteInfer(const char* model_path, const std::vector<size_t>& out_sizes): model_path_{model_path},
+                                                                                        capture("TfliteInfer", model_path),
+                                                                                        affinity("TfliteInfer", model_path),
+                                                                                        budget("TfliteInfer", model_path, 2.0, 1.0),
+                                                                                        stream(model_path)
 {
+    plugin_affinity::scope placed(affinity);
+    size_t resident = resident_bytes();
     model = tflite::FlatBufferModel::BuildFromFile(model_path_);
 
     tflite::LoggerOptions::SetMinimumLogSeverity(tflite::TFLITE_LOG_ERROR);
@@ -15,7 +32,8 @@ TfliteInfer::TfliteInfer(const char* model_path, const std::vector<size_t>& out_
         std::cerr << "Failed to load TFLite model: " << model_path_ << std::endl;
     }
 
-    tflite::InterpreterBuilder(*model, resolver)(&interpreter);
+    const tflite::OpResolver& op_resolver = budget.lean() ? static_cast<const tflite::OpResolver&>(lean_resolver) : resolver;
+    tflite::InterpreterBuilder(*model, op_resolver)(&interpreter);
     record_tensor_details();
     for(int i =0; i< num_outputs; ++i){
         if(output_shapes[i][0]<0){
@@ -24,22 +42,155 @@ TfliteInfer::TfliteInfer(const char* model_path, const std::vector<size_t>& out_
     }
     interpreter->AllocateTensors();
     interpreter->SetNumThreads(0);
+    // Delegates repack the weights while the tensors are first allocated, the arena itself is untouched yet
+    size_t load_growth = resident_growth(resident);
+
+    zero_copy_outputs = !dynamic_output && plugin_option_bool("MX_PLUGIN_ZERO_COPY", true);
+    bound_outputs.assign(num_outputs, nullptr);
+    bindable_outputs.assign(num_outputs, true);
+    owned_outputs.resize(num_outputs);
+    // fp16 outputs are converted into the FeatureMaps, they can't share their memory
+    for(int i=0; i<num_outputs; ++i)
+        if(interpreter->output_tensor(i)->type == kTfLiteFloat16)
+            bindable_outputs[i] = false;
+
+    pool_model = plugin_pool::instance().register_model(model_path_, affinity.get_node());
+    if(plugin_pool::enabled()){
+        bool rebound = false;
+        for(int i=0; i<num_inputs; ++i)
+            rebound |= bind_to_pool(interpreter->inputs()[i]);
+        // Zero-copy outputs get bound to the FeatureMaps instead
+        if(!zero_copy_outputs)
+            for(int i=0; i<num_outputs; ++i)
+                rebound |= bind_to_pool(interpreter->outputs()[i]);
+        if(rebound && interpreter->AllocateTensors() != kTfLiteOk)
+            throw std::runtime_error(std::string("TfliteInfer: AllocateTensors failed for ") + model_path_);
+    }
+
+    for(int i=0; i<num_inputs; ++i){
+        TfLiteTensor* tensor = interpreter->tensor(interpreter->inputs()[i]);
+        prefault(tensor->data.raw, tensor->bytes);
+    }
+    for(int i=0; i<num_outputs; ++i){
+        TfLiteTensor* tensor = interpreter->tensor(interpreter->outputs()[i]);
+        prefault(tensor->data.raw, tensor->bytes);
+    }
+    measure_footprint(load_growth);
+    budget.commit(footprint);
+    warmup.start("TfliteInfer", model_path_, [this](){ interpreter->Invoke(); });
+}
+
+void TfliteInfer::measure_footprint(size_t load_growth){
+    // The mapped model counts once its pages are read, repacked copies come on top
+    footprint.weights = std::max(model && model->allocation() ? model->allocation()->bytes() : 0, load_growth);
+    std::vector<bool> io_tensor(interpreter->tensors_size(), false);
+    for(int index : interpreter->inputs())
+        io_tensor[index] = true;
+    for(int index : interpreter->outputs())
+        io_tensor[index] = true;
+    for(size_t index = 0; index < interpreter->tensors_size(); ++index){
+        const TfLiteTensor* tensor = interpreter->tensor(index);
+        if(io_tensor[index])
+            footprint.io += tensor->bytes;
+        // Upper bound: the arena reuses memory between tensors that aren't alive at once
+        else if(tensor->allocation_type == kTfLiteArenaRw || tensor->allocation_type == kTfLiteArenaRwPersistent)
+            footprint.arena += tensor->bytes;
+    }
+}
+
+bool TfliteInfer::bind_to_pool(int tensor_index){
+    TfLiteTensor* tensor = interpreter->tensor(tensor_index);
+    if(tensor->allocation_type != kTfLiteArenaRw || tensor->bytes == 0)
+        return false;
+    std::unique_ptr<void, pool_deleter> data(plugin_pool::instance().allocate(tensor->bytes, pool_model));
+    if(!data)
+        return false;
+    TfLiteCustomAllocation allocation{data.get(), tensor->bytes};
+    if(interpreter->SetCustomAllocationForTensor(tensor_index, allocation) != kTfLiteOk)
+        return false;
+    pool_tensors.push_back(std::move(data));
+    return true;
+}
+
+bool TfliteInfer::bind_output(int i, void* data){
+    TfLiteTensor* tensor = interpreter->tensor(interpreter->outputs()[i]);
+    TfLiteCustomAllocation allocation{data, tensor->bytes};
+    if(interpreter->SetCustomAllocationForTensor(interpreter->outputs()[i], allocation) != kTfLiteOk)
+        return false;
+    bound_outputs[i] = data;
+    return true;
+}
+
+void TfliteInfer::bind_outputs(std::vector<MX::Types::FeatureMap<float>*>& output){
+    bool rebound = false;
+    for(int i=0; i<num_outputs; ++i){
+        if(!bindable_outputs[i] || owned_outputs[i])
+            continue;
+        void* data = output[i]->get_data_ptr();
+        if(data == bound_outputs[i])
+            continue;
+        if(reinterpret_cast<uintptr_t>(data) % tflite::kDefaultTensorAlignment == 0 && bind_output(i, data)){
+            rebound = true;
+            continue;
+        }
+        if(bound_outputs[i] == nullptr){
+            // Never bound (misaligned FeatureMap or e.g. a constant output): keep copying from the arena
+            bindable_outputs[i] = false;
+            continue;
+        }
+        // The output must not stay bound to a previous FeatureMap, move it to a private buffer for good
+        size_t bytes = interpreter->tensor(interpreter->outputs()[i])->bytes;
+        owned_outputs[i].reset(plugin_pool::instance().allocate(bytes, pool_model));
+        if(!owned_outputs[i] || !bind_output(i, owned_outputs[i].get()))
+            throw std::runtime_error("TfliteInfer: couldn't bind output " + output_names[i]);
+        rebound = true;
+    }
+    // Required after changing allocations, cheap once the tensors are custom allocated
+    if(rebound && interpreter->AllocateTensors() != kTfLiteOk)
+        throw std::runtime_error(std::string("TfliteInfer: AllocateTensors failed for ") + model_path_);
 }
 
 void TfliteInfer::runinference(std::vector<MX::Types::FeatureMap<float>*> input, std::vector<MX::Types::FeatureMap<float>*> output){
+    stream.run(output, [this](){ return output_sizes; }, [&](){ infer(input, output); });
+}
+
+void TfliteInfer::infer(std::vector<MX::Types::FeatureMap<float>*>& input, std::vector<MX::Types::FeatureMap<float>*>& output){
+    warmup.wait();
+    plugin_capture::call captured(capture, input, input_sizes, input_shapes);
+    if(reuse.lookup(input, input_sizes, output))
+        return;
+    // Before the inputs are written: a rebind may re-plan the arena
+    if(zero_copy_outputs)
+        bind_outputs(output);
     for(int i=0; i<num_inputs; ++i){
+        TfLiteTensor* tensor = interpreter->input_tensor(i);
+        if(tensor->type == kTfLiteFloat16){
+            float_to_half(input[i]->get_data_ptr(), reinterpret_cast<uint16_t*>(tensor->data.raw), input_sizes[i]);
+            continue;
+        }
         float* input_tensor = interpreter->typed_input_tensor<float>(i);
         input[i]->get_data(input_tensor);
     }
     interpreter->Invoke();
     for(int i=0; i<num_outputs; ++i){
+        TfLiteTensor* tensor = interpreter->output_tensor(i);
+        if(tensor->type == kTfLiteFloat16){
+            half_to_float(reinterpret_cast<const uint16_t*>(tensor->data.raw), output[i]->get_data_ptr(), output_sizes[i]);
+            continue;
+        }
         float* output_tensor = interpreter->typed_output_tensor<float>(i);
-        output[i]->set_data(output_tensor);
+        if(output_tensor != output[i]->get_data_ptr())
+            output[i]->set_data(output_tensor);
     }
+    reuse.store(input, input_sizes, output, output_sizes, false);
 }
 
 void TfliteInfer::runinference(std::vector<MX::Types::FeatureMap<uint8_t>*> input, std::vector<MX::Types::FeatureMap<uint8_t>*> output){}
 
+static size_t element_count(const TfLiteTensor* tensor){
+    return tensor->bytes / (tensor->type == kTfLiteFloat16 ? sizeof(uint16_t) : sizeof(float));
+}
+
 void TfliteInfer::record_tensor_details(){
     num_inputs = interpreter->inputs().size();
     for(int i=0;i<num_inputs;++i){
@@ -49,7 +200,7 @@ void TfliteInfer::record_tensor_details(){
             tmp.push_back(input_dims->data[j]);
         }
         input_shapes.push_back(tmp);
-        input_sizes.push_back(interpreter->tensor(interpreter->inputs()[i])->bytes/ sizeof(float));
+        input_sizes.push_back(element_count(interpreter->tensor(interpreter->inputs()[i])));
         input_names.push_back(interpreter->tensor(interpreter->inputs()[i])->name);
     }
 
@@ -61,7 +212,7 @@ void TfliteInfer::record_tensor_details(){
             tmp.push_back(output_dims->data[j]);
         }
         output_shapes.push_back(tmp);
-        output_sizes.push_back(interpreter->tensor(interpreter->outputs()[i])->bytes/ sizeof(float));
+        output_sizes.push_back(element_count(interpreter->tensor(interpreter->outputs()[i])));
         output_names.push_back(interpreter->tensor(interpreter->outputs()[i])->name);
     }
 }
@@ -86,6 +237,34 @@ std::vector<std::string>  TfliteInfer::get_input_names(){
     return input_names;
 }
 
+double TfliteInfer::get_warmup_ms(){
+    return warmup.elapsed_ms();
+}
+
+size_t TfliteInfer::get_pool_bytes(){
+    return plugin_pool::instance().get_usage(pool_model).bytes;
+}
+
+plugin_scheduler::stream_stats TfliteInfer::get_stream_stats(){
+    return stream.get_stats();
+}
+
+plugin_footprint TfliteInfer::get_footprint(){
+    return footprint;
+}
+
+uint64_t TfliteInfer::get_reuse_hits(){
+    return reuse.get_hits();
+}
+
+uint64_t TfliteInfer::get_reuse_misses(){
+    return reuse.get_misses();
+}
+
 TfliteInfer::~TfliteInfer(){
+    warmup.finish();
+    // The interpreter must go before the buffers bound to its tensors
     interpreter.reset();
+    pool_tensors.clear();
+    owned_outputs.clear();
 }
\ No newline at end of file
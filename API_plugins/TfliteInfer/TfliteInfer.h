@@ -6,12 +6,24 @@
 #include <tensorflow/lite/interpreter.h>
 #include <tensorflow/lite/kernels/register.h>
 #include <tensorflow/lite/model.h>
+#include "plugin_warmup.h"
+#include "plugin_pool.h"
+#include "plugin_fp16.h"
+#include "plugin_reuse.h"
+#include "plugin_capture.h"
+#include "plugin_affinity.h"
+#include "plugin_footprint.h"
+#include "plugin_scheduler.h"
+#include <memory>
+#include <cstdlib>
 
 class TfliteInfer : public PrePost{
     private:
         const char* model_path_;
         std::unique_ptr<tflite::FlatBufferModel> model;
         tflite::ops::builtin::BuiltinOpResolver resolver;
+        // Over the memory budget: no XNNPACK, kernels read the weights from the mapped file
+        tflite::ops::builtin::BuiltinOpResolverWithoutDefaultDelegates lean_resolver;
         std::unique_ptr<tflite::Interpreter> interpreter;
         void record_tensor_details();
         int num_inputs;
@@ -22,6 +34,29 @@ class TfliteInfer : public PrePost{
         std::vector<size_t> output_sizes;
         std::vector<std::string> input_names;
         std::vector<std::string> output_names;
+
+        // Zero-copy outputs: the output tensors are custom allocations on the
+        // FeatureMap memory, so Invoke writes the results in place.
+        bool zero_copy_outputs;
+        std::vector<void*> bound_outputs;
+        std::vector<bool> bindable_outputs;
+        std::vector<std::unique_ptr<void, pool_deleter>> owned_outputs;
+        void bind_outputs(std::vector<MX::Types::FeatureMap<float>*>& output);
+        bool bind_output(int i, void* data);
+
+        // I/O tensors moved out of the interpreter arena into the shared pool
+        int pool_model = -1;
+        std::vector<std::unique_ptr<void, pool_deleter>> pool_tensors;
+        bool bind_to_pool(int tensor_index);
+        plugin_warmup warmup;
+        plugin_reuse reuse;
+        plugin_capture capture;
+        plugin_affinity affinity;
+        plugin_budget::ticket budget;
+        plugin_footprint footprint;
+        plugin_stream stream;
+        void infer(std::vector<MX::Types::FeatureMap<float>*>& input, std::vector<MX::Types::FeatureMap<float>*>& output);
+        void measure_footprint(size_t load_growth);
     public:
         ~TfliteInfer();
         TfliteInfer(const char* model_path, const std::vector<size_t>& out_sizes);
@@ -33,10 +68,21 @@ class TfliteInfer : public PrePost{
         std::vector<size_t> get_input_sizes() override;
         std::vector<std::string> get_output_names() override;
         std::vector<std::string> get_input_names() override;
+        double get_warmup_ms();
+        size_t get_pool_bytes();
+        plugin_footprint get_footprint();
+        plugin_scheduler::stream_stats get_stream_stats();
+        uint64_t get_reuse_hits();
+        uint64_t get_reuse_misses();
 };
 
+// createTfliteBatch builds all models on a loader pool at once and returns
+// when every one is ready, with one handle per path in the same order.
+// reloadTflite swaps a new model into such a handle between two calls.
 extern "C" {
     PrePost* createTflite(const char* model_path, const std::vector<size_t>& out_sizes);
+    void createTfliteBatch(const std::vector<std::string>& model_paths, const std::vector<std::vector<size_t>>& out_sizes, std::vector<PrePost*>& models);
+    bool reloadTflite(PrePost* plugin, const char* model_path, bool wait);
 }
 
 #endif
@@ -0,0 +1,191 @@
+// Headless throughput benchmark for mxutils_gui.
+//
+// Runs MxQt/DisplayScreen on Qt's offscreen platform and drives N synthetic
+// producer threads through SetSquareLayout + GetDisplayFrameBuf + SetDisplayFrame,
+// then reports per-viewer paint FPS, dropped frames, submit to paint latency,
+// GUI thread utilization and RSS.
+//
+// Usage: mxutils_gui_bench [--channels N] [--fps R] [--seconds S]
+//                          [--width W --height H] [--format rgb|bgr|nv12]
+
+#include "../gui_view.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <sys/resource.h>
+
+struct BenchConfig
+{
+    int channels = 4;
+    double fps = 30;
+    double seconds = 10;
+    int width = 0;  // 0: draw directly into GetDisplayFrameBuf
+    int height = 0;
+    PixelFormat format = PixelFormat::RGB;
+};
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [--channels N] [--fps R] [--seconds S] [--width W --height H] [--format rgb|bgr|nv12]\n", prog);
+}
+
+static bool parse_args(int argc, char *argv[], BenchConfig &cfg)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (i + 1 >= argc)
+            return false;
+        string val = argv[++i];
+        if (arg == "--channels")
+            cfg.channels = atoi(val.c_str());
+        else if (arg == "--fps")
+            cfg.fps = atof(val.c_str());
+        else if (arg == "--seconds")
+            cfg.seconds = atof(val.c_str());
+        else if (arg == "--width")
+            cfg.width = atoi(val.c_str());
+        else if (arg == "--height")
+            cfg.height = atoi(val.c_str());
+        else if (arg == "--format")
+        {
+            if (val == "rgb")
+                cfg.format = PixelFormat::RGB;
+            else if (val == "bgr")
+                cfg.format = PixelFormat::BGR;
+            else if (val == "nv12")
+                cfg.format = PixelFormat::NV12;
+            else
+                return false;
+        }
+        else
+            return false;
+    }
+    return cfg.channels > 0 && cfg.fps > 0 && cfg.seconds > 0;
+}
+
+static double thread_cpu_seconds()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static long status_kb(const char *key)
+{
+    std::ifstream status("/proc/self/status");
+    string line;
+    size_t key_len = strlen(key);
+    while (std::getline(status, line))
+    {
+        if (line.compare(0, key_len, key) == 0)
+            return atol(line.c_str() + key_len + 1);
+    }
+    return -1;
+}
+
+// Moving gradient so consecutive frames differ
+static void fill_frame(cv::Mat &frame, PixelFormat format, int seq)
+{
+    int channels = (format == PixelFormat::NV12) ? 1 : 3;
+    for (int r = 0; r < frame.rows; r++)
+    {
+        uchar *p = frame.ptr<uchar>(r);
+        for (int c = 0; c < frame.cols * channels; c++)
+            p[c] = (uchar)(r + c + seq * 4);
+    }
+}
+
+static void producer(DisplayScreen *screen, int viewer_id, const BenchConfig &cfg, std::atomic<bool> &stop)
+{
+    // Own ring of source frames when a source resolution is given
+    vector<cv::Mat> ring;
+    if (cfg.width > 0 && cfg.height > 0)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            if (cfg.format == PixelFormat::NV12)
+                ring.emplace_back(cfg.height * 3 / 2, cfg.width, CV_8UC1);
+            else
+                ring.emplace_back(cfg.height, cfg.width, CV_8UC3);
+        }
+    }
+
+    auto period = chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(1.0 / cfg.fps));
+    auto next = chrono::steady_clock::now();
+    int seq = 0;
+    while (!stop)
+    {
+        cv::Mat *frame;
+        PixelFormat format = cfg.format;
+        if (ring.empty())
+        {
+            frame = screen->GetDisplayFrameBuf(viewer_id);
+            format = PixelFormat::RGB;
+        }
+        else
+        {
+            frame = &ring[seq % ring.size()];
+        }
+        fill_frame(*frame, format, seq++);
+        screen->SetDisplayFrame(viewer_id, frame, format, (float)cfg.fps);
+
+        next += period;
+        std::this_thread::sleep_until(next);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    BenchConfig cfg;
+    if (!parse_args(argc, argv, cfg))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (qgetenv("QT_QPA_PLATFORM").isEmpty())
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+
+    MxQt gui(argc, argv);
+    DisplayScreen *screen = gui.screens[0];
+    screen->SetSquareLayout(cfg.channels);
+
+    std::atomic<bool> stop(false);
+    vector<std::thread> producers;
+    double gui_cpu_start = thread_cpu_seconds();
+    auto wall_start = chrono::steady_clock::now();
+    for (int i = 0; i < cfg.channels; i++)
+        producers.emplace_back(producer, screen, i, std::cref(cfg), std::ref(stop));
+
+    QTimer::singleShot((int)(cfg.seconds * 1000), [&]() {
+        double gui_cpu = thread_cpu_seconds() - gui_cpu_start;
+        double wall = chrono::duration<double>(chrono::steady_clock::now() - wall_start).count();
+        stop = true;
+        for (std::thread &t : producers)
+            t.join();
+
+        printf("screen %ux%u, %d channels @ %.1f fps, source %s, %.1f s\n", screen->width(), screen->height(),
+               cfg.channels, cfg.fps, cfg.width > 0 ? (std::to_string(cfg.width) + "x" + std::to_string(cfg.height)).c_str() : "display buffer",
+               wall);
+        printf("%-4s %9s %9s %9s %9s %9s %9s %9s %9s %9s %9s\n", "ch", "paintfps", "submit", "painted", "dropped",
+               "p50ms", "p90ms", "p99ms", "maxms", "jitterms", "paintms");
+        for (int i = 0; i < cfg.channels; i++)
+        {
+            ViewerStats s = screen->GetViewerStats(i);
+            printf("%-4d %9.1f %9lu %9lu %9lu %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f\n", i, s.paint_fps,
+                   (unsigned long)s.frames_submitted, (unsigned long)s.frames_painted, (unsigned long)s.frames_dropped,
+                   s.latency_p50_ms, s.latency_p90_ms, s.latency_p99_ms, s.latency_max_ms,
+                   s.frame_jitter_ms, s.paint_time_avg_ms);
+        }
+        printf("gui thread utilization %.1f%%\n", 100.0 * gui_cpu / wall);
+        printf("rss %ld kB, peak rss %ld kB\n", status_kb("VmRSS"), status_kb("VmHWM"));
+        QCoreApplication::quit();
+    });
+
+    return gui.Run();
+}
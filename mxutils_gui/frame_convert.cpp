@@ -0,0 +1,110 @@
+#include "frame_convert.h"
+
+static int ResizeInterpolation(cv::Size src, cv::Size dst)
+{
+    // INTER_AREA has fast paths for integer downscale factors, bilinear is fine otherwise
+    if (src.width >= 2 * dst.width && src.height >= 2 * dst.height)
+        return cv::INTER_AREA;
+    return cv::INTER_LINEAR;
+}
+
+static void ResizePlane(const cv::Mat &src, cv::Mat &dst, cv::Size size)
+{
+    if (src.size() == size)
+        src.copyTo(dst);
+    else
+        cv::resize(src, dst, size, 0, 0, ResizeInterpolation(src.size(), size));
+}
+
+// True when writing into dst could touch pixels it doesn't own: a frame passed
+// through by an earlier call, external memory, or the source itself
+static bool MayAlias(const cv::Mat &dst, const cv::Mat &src)
+{
+    if (dst.data == nullptr)
+        return false;
+    return dst.u == nullptr || dst.datastart == src.datastart || CV_XADD(&dst.u->refcount, 0) > 1;
+}
+
+cv::Size FrameImageSize(const cv::Mat &src, PixelFormat format)
+{
+    switch (format)
+    {
+    case PixelFormat::NV12:
+    case PixelFormat::I420:
+        return cv::Size(src.cols, src.rows * 2 / 3);
+    default:
+        return src.size();
+    }
+}
+
+void ConvertFrameToRGB(const cv::Mat &src, PixelFormat format, cv::Size dst_size, cv::Mat &dst, cv::Mat &scratch)
+{
+    cv::Size src_size = FrameImageSize(src, format);
+    if (MayAlias(dst, src))
+        dst.release();
+
+    switch (format)
+    {
+    case PixelFormat::RGB:
+        if (src_size == dst_size)
+            dst = src;
+        else
+            cv::resize(src, dst, dst_size, 0, 0, ResizeInterpolation(src_size, dst_size));
+        break;
+
+    case PixelFormat::BGR:
+    case PixelFormat::BGRA:
+    {
+        int code = (format == PixelFormat::BGR) ? cv::COLOR_BGR2RGB : cv::COLOR_BGRA2RGB;
+        if (src_size == dst_size)
+        {
+            cv::cvtColor(src, dst, code);
+        }
+        else
+        {
+            cv::resize(src, scratch, dst_size, 0, 0, ResizeInterpolation(src_size, dst_size));
+            cv::cvtColor(scratch, dst, code);
+        }
+        break;
+    }
+
+    case PixelFormat::NV12:
+    case PixelFormat::I420:
+    {
+        // Chroma is subsampled 2x2, keep the resampled planes even-sized
+        cv::Size y_size(dst_size.width & ~1, dst_size.height & ~1);
+        cv::Size c_size(y_size.width / 2, y_size.height / 2);
+        int sw = src_size.width, sh = src_size.height;
+
+        cv::Mat src_y(sh, sw, CV_8UC1, (void *)src.ptr(0), src.step);
+        scratch.create(y_size.height * 3 / 2, y_size.width, CV_8UC1);
+        cv::Mat dst_y = scratch.rowRange(0, y_size.height);
+        ResizePlane(src_y, dst_y, y_size);
+
+        if (format == PixelFormat::NV12)
+        {
+            cv::Mat src_uv(sh / 2, sw / 2, CV_8UC2, (void *)src.ptr(sh), src.step);
+            cv::Mat dst_uv(c_size, CV_8UC2, scratch.ptr(y_size.height), scratch.step);
+            ResizePlane(src_uv, dst_uv, c_size);
+            cv::cvtColorTwoPlane(dst_y, dst_uv, dst, cv::COLOR_YUV2RGB_NV12);
+        }
+        else
+        {
+            if (!src.isContinuous())
+                throw std::runtime_error("QtUtil error: I420 frames must be continuous.");
+            size_t c_src = (size_t)(sw / 2) * (sh / 2);
+            size_t c_dst = (size_t)c_size.width * c_size.height;
+            const uchar *src_u = src.ptr(sh);
+            uchar *dst_u = scratch.ptr(y_size.height);
+            cv::Mat su(sh / 2, sw / 2, CV_8UC1, (void *)src_u);
+            cv::Mat sv(sh / 2, sw / 2, CV_8UC1, (void *)(src_u + c_src));
+            cv::Mat du(c_size, CV_8UC1, dst_u);
+            cv::Mat dv(c_size, CV_8UC1, dst_u + c_dst);
+            ResizePlane(su, du, c_size);
+            ResizePlane(sv, dv, c_size);
+            cv::cvtColor(scratch, dst, cv::COLOR_YUV2RGB_I420);
+        }
+        break;
+    }
+    }
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "gui_view.h"
+
+/**
+ * @brief Converts a frame of any supported pixel format to RGB888 of the given display size.
+ *
+ * Resampling is done on the source planes before the color conversion, so only the
+ * pixels that are actually displayed get converted. Both steps use the SIMD kernels
+ * of OpenCV (resize, cvtColor, cvtColorTwoPlane).
+ *
+ * @param src The source frame in `format` layout. Planar formats must be continuous.
+ * @param format The pixel format of the source frame.
+ * @param dst_size The size of the displayed image.
+ * @param dst Output RGB888 image; may alias the pixels of `src` when no work is needed.
+ *            Such an alias is dropped on the next call before anything is written.
+ * @param scratch Intermediate buffer reused across calls to avoid reallocation.
+ */
+void ConvertFrameToRGB(const cv::Mat &src, PixelFormat format, cv::Size dst_size, cv::Mat &dst, cv::Mat &scratch);
+
+/**
+ * @brief Returns the width and height of the image stored in a frame of the given format.
+ */
+cv::Size FrameImageSize(const cv::Mat &src, PixelFormat format);
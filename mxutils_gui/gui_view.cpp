@@ -1,4 +1,11 @@
 #include "gui_view.h"
+#include "frame_convert.h"
+#include "overlay_renderer.h"
+#include "recording_sink.h"
+#include "mjpeg_server.h"
+#include "render_worker.h"
+#include <algorithm>
+#include <cmath>
 
 
 #define LabelDefaultStyle (          \
@@ -33,11 +40,37 @@
     "    text-align: center;"        \
     "}")
 
-MxQt::MxQt(int &argc, char *argv[]) : app(argc, argv)
+#define HUDStyle (                   \
+    "QLabel {"                       \
+    "    font-size: 13px;"           \
+    "    font-family: monospace;"    \
+    "    color: #14FF39;"            \
+    "    background-color: rgba(0, 0, 0, 160);" \
+    "    padding: 4px;"              \
+    "}")
+
+MxQt::MxQt(int &argc, char *argv[]) : headless_(false), app(argc, argv)
+{
+    InitScreens(0, 0);
+}
+
+static bool SelectHeadlessPlatform(bool headless)
+{
+    if (headless)
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    return headless;
+}
+
+MxQt::MxQt(int &argc, char *argv[], bool headless, int width, int height) : headless_(SelectHeadlessPlatform(headless)), app(argc, argv)
+{
+    InitScreens(width, height);
+}
+
+void MxQt::InitScreens(int width, int height)
 {
     int width_offset = 0;
 
-    num_screens = app.screens().size();
+    num_screens = headless_ ? 1 : app.screens().size();
 
     for (int i = 0; i < num_screens; i++)
     {
@@ -45,12 +78,41 @@ MxQt::MxQt(int &argc, char *argv[]) : app(argc, argv)
         DisplayScreen *screen = new DisplayScreen(nullptr, qscreen);
         int w = app.screens().at(i)->geometry().width();
         int h = app.screens().at(i)->geometry().height();
+        if (headless_)
+        {
+            // The offscreen platform has a fixed small screen, use the requested size instead
+            w = width;
+            h = height;
+            screen->headless_ = true;
+            screen->w_ = w;
+            screen->h_ = h;
+        }
         screen->setGeometry(width_offset, 0, w, h);
-        width_offset += app.screens().at(i)->geometry().width();
+        width_offset += w;
         screens.push_back(screen);
     }
 }
 
+bool MxQt::StartStreaming(uint16_t port, int jpeg_quality, const string &bind_address)
+{
+    if (stream_server_)
+        return false;
+    stream_server_ = new MjpegServer(screens, jpeg_quality);
+    if (!stream_server_->Start(bind_address, port))
+    {
+        delete stream_server_;
+        stream_server_ = nullptr;
+        return false;
+    }
+    return true;
+}
+
+void MxQt::StopStreaming()
+{
+    delete stream_server_;
+    stream_server_ = nullptr;
+}
+
 int MxQt::Run()
 {
     for (int i = 0; i < num_screens; i++)
@@ -61,25 +123,128 @@ int MxQt::Run()
 
 MxQt::~MxQt()
 {
+    StopStreaming();
+    app.processEvents(); // run the queued sink detaches
     for (uint32_t i = 0; i < screens.size(); i++)
         delete screens[i];
 }
 
+#define RepaintDefaultRefreshRate 60.0
+#define RepaintDefaultLabelRate 4.0
+
+RepaintScheduler::RepaintScheduler(DisplayScreen *screen, QScreen *qscreen) : QObject(screen), screen_(screen)
+{
+    this->label_rate_ = RepaintDefaultLabelRate;
+    this->ticks_since_labels_ = 0;
+
+    if (qscreen == nullptr)
+        qscreen = QGuiApplication::primaryScreen();
+
+    timer_.setTimerType(Qt::PreciseTimer);
+    connect(&timer_, &QTimer::timeout, this, &RepaintScheduler::slot_Tick);
+    if (qscreen != nullptr)
+    {
+        connect(qscreen, &QScreen::refreshRateChanged, this, &RepaintScheduler::SetRefreshRate);
+        SetRefreshRate(qscreen->refreshRate());
+    }
+    else
+    {
+        SetRefreshRate(RepaintDefaultRefreshRate);
+    }
+    timer_.start();
+}
+
+RepaintScheduler::~RepaintScheduler()
+{
+    timer_.stop();
+}
+
+void RepaintScheduler::SetRefreshRate(qreal refresh_rate)
+{
+    if (refresh_rate <= 0)
+        refresh_rate = RepaintDefaultRefreshRate;
+    this->refresh_rate_ = refresh_rate;
+    timer_.setInterval(std::max(1, (int)(1000.0 / refresh_rate)));
+    SetLabelRate(this->label_rate_);
+}
+
+void RepaintScheduler::SetLabelRate(qreal label_rate)
+{
+    if (label_rate <= 0)
+        label_rate = RepaintDefaultLabelRate;
+    this->label_rate_ = label_rate;
+    this->label_interval_ticks_ = std::max(1, (int)std::lround(this->refresh_rate_ / label_rate));
+}
+
+void RepaintScheduler::MarkDirty(FrameViewer *viewer)
+{
+    lock_guard<mutex> lock(dirty_mutex_);
+    dirty_viewers_.push_back(viewer);
+}
+
+void RepaintScheduler::Forget(FrameViewer *viewer)
+{
+    lock_guard<mutex> lock(dirty_mutex_);
+    dirty_viewers_.erase(std::remove(dirty_viewers_.begin(), dirty_viewers_.end(), viewer), dirty_viewers_.end());
+}
+
+void RepaintScheduler::slot_Tick()
+{
+    {
+        lock_guard<mutex> lock(dirty_mutex_);
+        tick_viewers_.swap(dirty_viewers_);
+    }
+    // Each viewer is queued at most once until its pending frame has been rendered
+    if (!tick_viewers_.empty())
+        screen_->render_worker_->Post(tick_viewers_);
+    tick_viewers_.clear();
+
+    if (++ticks_since_labels_ >= label_interval_ticks_)
+    {
+        ticks_since_labels_ = 0;
+        for (QWidget *object : screen_->viewers_)
+            ((FrameViewer *)object)->RefreshLabels();
+    }
+}
+
 DisplayScreen::DisplayScreen() : QWidget() // default constructor
 {
     this->running_ = true;
+    this->num_viewers_ = 0;
+    this->scheduler_ = new RepaintScheduler(this, nullptr);
+    this->render_worker_ = new RenderWorker(this);
+    this->setContextMenuPolicy(Qt::CustomContextMenu);
+    connect(this, &QWidget::customContextMenuRequested, this, &DisplayScreen::showInferencePopUpMenu);
 }
 
 DisplayScreen::DisplayScreen(QWidget *parent = nullptr, QScreen *qscreen = nullptr) : QWidget(parent)
 {
     this->running_ = true;
+    this->num_viewers_ = 0;
     this->w_ = qscreen->geometry().width();
     this->h_ = qscreen->geometry().height();
+    this->scheduler_ = new RepaintScheduler(this, qscreen);
+    this->render_worker_ = new RenderWorker(this);
+    this->setContextMenuPolicy(Qt::CustomContextMenu);
+    connect(this, &QWidget::customContextMenuRequested, this, &DisplayScreen::showInferencePopUpMenu);
 }
 
 DisplayScreen::~DisplayScreen()
 {
     this->running_ = false;
+    // No rendering past this point, the viewers and sinks go away below
+    delete render_worker_;
+    while (true)
+    {
+        int viewer_id;
+        {
+            lock_guard<mutex> lock(sinks_mutex_);
+            if (recordings_.empty())
+                break;
+            viewer_id = recordings_.begin()->first;
+        }
+        StopRecording(viewer_id);
+    }
     for (uint32_t idx = 0; idx < this->num_viewers_; idx++)
     {
         QObject *object = viewers_[idx];
@@ -91,18 +256,18 @@ DisplayScreen::~DisplayScreen()
 // TODO: make it a function directly in FrameViewer
 void DisplayScreen::SetDisplayFrame(int viewer_id, cv::Mat *frame, float fps)
 {
-    QObject *object = viewers_[viewer_id];
-
-    FrameViewer *viewer = (FrameViewer *)object;
+    FrameViewer *viewer = Viewer(viewer_id);
+    if (viewer == nullptr)
+        return;
     viewer->UpdateFrame(frame);
     viewer->UpdateFPS(fps);
 }
 
 void DisplayScreen::SetDisplayFrame(int viewer_id, cv::Mat *frame)
 {
-    QObject *object = viewers_[viewer_id];
-
-    FrameViewer *viewer = (FrameViewer *)object;
+    FrameViewer *viewer = Viewer(viewer_id);
+    if (viewer == nullptr)
+        return;
     viewer->UpdateFrame(frame);
     viewer->HideFPS();
     viewer->HideChannelName();
@@ -113,14 +278,262 @@ void DisplayScreen::SetDisplayFrame(int viewer_id, cv::Mat frame)
     SetDisplayFrame(viewer_id, &frame);
 }
 
+void DisplayScreen::SetDisplayFrame(int viewer_id, cv::Mat *frame, PixelFormat format, float fps)
+{
+    FrameViewer *viewer = Viewer(viewer_id);
+    if (viewer == nullptr)
+        return;
+    viewer->UpdateFrame(frame, format);
+    viewer->UpdateFPS(fps);
+}
+
+void DisplayScreen::SetDisplayFrame(int viewer_id, cv::Mat *frame, PixelFormat format)
+{
+    FrameViewer *viewer = Viewer(viewer_id);
+    if (viewer == nullptr)
+        return;
+    viewer->UpdateFrame(frame, format);
+    viewer->HideFPS();
+    viewer->HideChannelName();
+}
+
+void DisplayScreen::SetDisplayFrame(int viewer_id, cv::Mat *frame, PixelFormat format, vector<OverlayItem> overlay, float fps)
+{
+    FrameViewer *viewer = Viewer(viewer_id);
+    if (viewer == nullptr)
+        return;
+    viewer->UpdateFrame(frame, format, std::move(overlay));
+    viewer->UpdateFPS(fps);
+}
+
+void DisplayScreen::SetDisplayFrame(int viewer_id, cv::Mat *frame, PixelFormat format, vector<OverlayItem> overlay, float fps,
+                                    chrono::steady_clock::time_point capture_time)
+{
+    FrameViewer *viewer = Viewer(viewer_id);
+    if (viewer == nullptr)
+        return;
+    viewer->UpdateFrame(frame, format, std::move(overlay), capture_time);
+    viewer->UpdateFPS(fps);
+}
+
+void DisplayScreen::SetDisplayFrame(int viewer_id, cv::Mat *frame, PixelFormat format, vector<OverlayItem> overlay)
+{
+    FrameViewer *viewer = Viewer(viewer_id);
+    if (viewer == nullptr)
+        return;
+    viewer->UpdateFrame(frame, format, std::move(overlay));
+    viewer->HideFPS();
+    viewer->HideChannelName();
+}
+
 cv::Mat *DisplayScreen::GetDisplayFrameBuf(int viewer_id)
 {
-    QObject *object = viewers_[viewer_id];
+    FrameViewer *viewer = Viewer(viewer_id);
+    if (viewer == nullptr)
+        return nullptr;
+    return viewer->NextDisplayFrameBuf();
+}
 
-    FrameViewer *viewer = (FrameViewer *)object;
-    cv::Mat *display_frame = viewer->display_frame_list_.at(viewer->display_frame_idx_);
-    viewer->display_frame_idx_ = (viewer->display_frame_idx_ + 1) % viewer->display_frame_list_.size();
-    return display_frame;
+ViewerStats DisplayScreen::GetViewerStats(int viewer_id)
+{
+    FrameViewer *viewer = Viewer(viewer_id);
+    if (viewer == nullptr)
+        return ViewerStats();
+    return viewer->GetStats();
+}
+
+void DisplayScreen::ResetViewerStats(int viewer_id)
+{
+    FrameViewer *viewer = Viewer(viewer_id);
+    if (viewer == nullptr)
+        return;
+    viewer->ResetStats();
+}
+
+void DisplayScreen::ShowStatsHUD(bool show, int viewer_id)
+{
+    for (uint32_t idx = 0; idx < viewers_.size(); idx++)
+    {
+        if (viewer_id >= 0 && (uint32_t)viewer_id != idx)
+            continue;
+        ((FrameViewer *)viewers_[idx])->ShowHUD(show);
+    }
+}
+
+void DisplayScreen::AddFrameSink(int viewer_id, shared_ptr<FrameSink> sink)
+{
+    if (viewer_id < 0)
+    {
+        lock_guard<mutex> lock(sinks_mutex_);
+        mosaic_sinks_.push_back(sink);
+        return;
+    }
+    FrameViewer *viewer = Viewer(viewer_id);
+    if (viewer == nullptr)
+        return;
+    viewer->AddSink(sink);
+}
+
+void DisplayScreen::RemoveFrameSink(int viewer_id, shared_ptr<FrameSink> sink)
+{
+    if (viewer_id < 0)
+    {
+        lock_guard<mutex> lock(sinks_mutex_);
+        mosaic_sinks_.erase(std::remove(mosaic_sinks_.begin(), mosaic_sinks_.end(), sink), mosaic_sinks_.end());
+        return;
+    }
+    FrameViewer *viewer = Viewer(viewer_id);
+    if (viewer == nullptr)
+        return;
+    viewer->RemoveSink(sink);
+}
+
+bool DisplayScreen::StartRecording(int viewer_id, const RecordingConfig &config)
+{
+    shared_ptr<RecordingSink> recording;
+    {
+        lock_guard<mutex> lock(sinks_mutex_);
+        if (recordings_.count(viewer_id))
+            return false;
+        recording = make_shared<RecordingSink>(config);
+        recordings_[viewer_id] = recording;
+    }
+    AddFrameSink(viewer_id, recording);
+    return true;
+}
+
+void DisplayScreen::StopRecording(int viewer_id)
+{
+    shared_ptr<RecordingSink> recording;
+    {
+        lock_guard<mutex> lock(sinks_mutex_);
+        auto it = recordings_.find(viewer_id);
+        if (it == recordings_.end())
+            return;
+        recording = it->second;
+        recordings_.erase(it);
+    }
+    RemoveFrameSink(viewer_id, recording);
+    recording->Stop();
+}
+
+RecordingStats DisplayScreen::GetRecordingStats(int viewer_id)
+{
+    lock_guard<mutex> lock(sinks_mutex_);
+    auto it = recordings_.find(viewer_id);
+    if (it == recordings_.end())
+        return RecordingStats();
+    return it->second->GetStats();
+}
+
+void DisplayScreen::resizeEvent(QResizeEvent *event)
+{
+    QWidget::resizeEvent(event);
+    // Actual widget size: differs from the screen size in windowed mode
+    lock_guard<mutex> lock(sinks_mutex_);
+    mosaic_size_ = cv::Size(event->size().width(), event->size().height());
+}
+
+void DisplayScreen::ComposeMosaic(cv::Point origin, const cv::Mat &rgb)
+{
+    cv::Size size;
+    bool clear;
+    {
+        lock_guard<mutex> lock(sinks_mutex_);
+        if (mosaic_sinks_.empty())
+            return;
+        size = mosaic_size_;
+        clear = mosaic_clear_;
+        mosaic_clear_ = false;
+    }
+    if (size.empty())
+        return;
+    if (mosaic_.size() != size)
+        mosaic_ = cv::Mat::zeros(size, CV_8UC3);
+    else if (clear)
+        mosaic_.setTo(cv::Scalar::all(0));
+
+    cv::Rect target = cv::Rect(origin.x, origin.y, rgb.cols, rgb.rows) & cv::Rect(0, 0, size.width, size.height);
+    if (target.empty())
+        return;
+    rgb(cv::Rect(0, 0, target.width, target.height)).copyTo(mosaic_(target));
+    mosaic_dirty_ = true;
+}
+
+void DisplayScreen::FlushMosaic()
+{
+    if (!mosaic_dirty_)
+        return;
+    mosaic_dirty_ = false;
+
+    vector<shared_ptr<FrameSink>> sinks;
+    {
+        lock_guard<mutex> lock(sinks_mutex_);
+        sinks = mosaic_sinks_;
+    }
+    auto now = chrono::steady_clock::now();
+    for (auto &sink : sinks)
+        sink->OnFrame(mosaic_, now);
+}
+
+void DisplayScreen::QueuePresent(FrameViewer *viewer)
+{
+    bool post;
+    {
+        lock_guard<mutex> lock(present_mutex_);
+        if (std::find(present_viewers_.begin(), present_viewers_.end(), viewer) != present_viewers_.end())
+            return;
+        post = present_viewers_.empty();
+        present_viewers_.push_back(viewer);
+    }
+    // One queued call per batch of rendered viewers
+    if (post)
+        QMetaObject::invokeMethod(this, [this]() { PresentReady(); }, Qt::QueuedConnection);
+}
+
+void DisplayScreen::PresentReady()
+{
+    {
+        lock_guard<mutex> lock(present_mutex_);
+        presenting_viewers_.swap(present_viewers_);
+    }
+    for (FrameViewer *viewer : presenting_viewers_)
+        viewer->Present();
+    presenting_viewers_.clear();
+}
+
+void DisplayScreen::showInferencePopUpMenu(const QPoint &pos)
+{
+    QMenu menu(this);
+
+    vector<FrameViewer *> active = ActiveViewers();
+    bool all_visible = !active.empty();
+    for (FrameViewer *viewer : active)
+        all_visible &= viewer->HUDVisible();
+    QAction *all_action = menu.addAction("Show statistics");
+    all_action->setCheckable(true);
+    all_action->setChecked(all_visible);
+
+    // The viewer under the cursor, if any
+    int viewer_id = -1;
+    QAction *viewer_action = nullptr;
+    for (FrameViewer *viewer : active)
+    {
+        if (viewer->geometry().contains(pos))
+        {
+            viewer_id = viewer->idx_;
+            viewer_action = menu.addAction("Show statistics for CH" + QString::number(viewer->idx_));
+            viewer_action->setCheckable(true);
+            viewer_action->setChecked(viewer->HUDVisible());
+            break;
+        }
+    }
+
+    QAction *chosen = menu.exec(mapToGlobal(pos));
+    if (chosen == all_action)
+        ShowStatsHUD(all_action->isChecked());
+    else if (chosen != nullptr && chosen == viewer_action)
+        ShowStatsHUD(viewer_action->isChecked(), viewer_id);
 }
 
 uint32_t DisplayScreen::width()
@@ -135,105 +548,243 @@ uint32_t DisplayScreen::height()
 
 uint32_t DisplayScreen::GetViewerWidth(int viewer_id)
 {
-    QObject *object = viewers_[viewer_id];
-
-    FrameViewer *viewer = (FrameViewer *)object;
+    FrameViewer *viewer = Viewer(viewer_id);
+    if (viewer == nullptr)
+        return 0;
     return viewer->width();
 }
 
 uint32_t DisplayScreen::GetViewerHeight(int viewer_id)
 {
-    QObject *object = viewers_[viewer_id];
-
-    FrameViewer *viewer = (FrameViewer *)object;
+    FrameViewer *viewer = Viewer(viewer_id);
+    if (viewer == nullptr)
+        return 0;
     return viewer->height();
 }
 
-void DisplayScreen::SetSquareLayout(int num_channels, bool fullscreen)
+FrameViewer *DisplayScreen::Viewer(int viewer_id)
+{
+    lock_guard<mutex> lock(viewers_mutex_);
+    if (viewer_id < 0 || (size_t)viewer_id >= viewers_.size())
+        return nullptr;
+    return (FrameViewer *)viewers_[viewer_id];
+}
+
+void DisplayScreen::SetupWindow(bool fullscreen)
 {
-    static int idx = 0;
     bool create_exit_button;
-    int screen_width;
-    int screen_height;
-    if(fullscreen){
+    if(headless_){
+        // Nothing to go fullscreen on, keep the virtual screen size
         create_exit_button = false;
-        screen_width = this->width();
-        screen_height = this->height();
+        this->setFixedSize(this->width(), this->height());
+        layout_w_ = this->width();
+        layout_h_ = this->height();
+        fullscreen = false;
     }
-    else{
+    else if(fullscreen){
         create_exit_button = true;
+        layout_w_ = this->width();
+        layout_h_ = this->height();
+    }
+    else{
+        create_exit_button = false;
         this->setFixedSize(1280, 720);
-        screen_width = 1280;
-        screen_height = 720;
+        layout_w_ = 1280;
+        layout_h_ = 720;
     }
-    vector<ViewerGeometry> viewer_geometry;
 
+    if (create_exit_button && exit_button_ == nullptr)
     {
-        // NxN layout
-        int mode = ceil(sqrt(num_channels));
+        exit_button_ = new QPushButton("Exit", this);
+        QObject::connect(exit_button_, &QPushButton::clicked, &QCoreApplication::quit);
+    }
+    if (exit_button_)
+    {
+        exit_button_->setGeometry(layout_w_ - 60, 0, 60, 25); // FIXME
+        exit_button_->setVisible(create_exit_button);
+    }
 
-        int geo_w, geo_h;
-        geo_w = int((screen_width) / mode);
-        geo_w &= (~0x1f); // sws_scale needs width to be 32x
-        geo_h = int((screen_height) / mode);
-        geo_h = (geo_w * 9) / 16;
+    if(fullscreen)
+    this->setWindowState(Qt::WindowFullScreen);
+}
 
-        viewer_geometry.clear();
+vector<FrameViewer *> DisplayScreen::ActiveViewers()
+{
+    vector<FrameViewer *> active;
+    for (QWidget *object : viewers_)
+    {
+        FrameViewer *viewer = (FrameViewer *)object;
+        if (viewer->IsActive())
+            active.push_back(viewer);
+    }
+    return active;
+}
 
-        for (int i = 0; i < num_channels; i++)
+FrameViewer *DisplayScreen::AcquireViewer()
+{
+    // Reuse the lowest removed channel, with its buffers, before creating a new viewer
+    for (QWidget *object : viewers_)
+    {
+        FrameViewer *viewer = (FrameViewer *)object;
+        if (!viewer->IsActive())
         {
-            int x = (i % mode) * geo_w;
-            int y = ((i / mode) * (geo_h));
-            ViewerGeometry cg = {x, y, geo_w, geo_h};
-            viewer_geometry.push_back(cg);
+            viewer->SetActive(true);
+            return viewer;
         }
-
-        this->viewer_geometry_ = viewer_geometry;
     }
 
-    // init and set all necessary components in each widget
+    FrameViewer *viewer = new FrameViewer(this);
+    viewer->SetIdx(viewers_.size()); // the viewer index, shown as the channel name
+    this->AddViewer(viewer);
+    viewer->show(); // children added after the screen is shown stay hidden otherwise
+    return viewer;
+}
 
-    for (int i = 0; i < num_channels; i++)
+void DisplayScreen::ResizeChannels(size_t num_channels)
+{
+    vector<FrameViewer *> active = ActiveViewers();
+    while (active.size() > num_channels)
     {
-        ViewerGeometry &cg = viewer_geometry.at(i);
+        active.back()->SetActive(false);
+        active.pop_back();
+    }
+    while (active.size() < num_channels)
+        active.push_back(AcquireViewer());
+}
+
+void DisplayScreen::PlaceViewer(FrameViewer *viewer, const ViewerGeometry &geometry)
+{
+    // Untouched viewers keep painting without a resize
+    if (viewer->geometry() != QRect(geometry.x, geometry.y, geometry.w, geometry.h) || viewer->display_frame_list_.empty())
+        viewer->SetGeometry(geometry.x, geometry.y, geometry.w, geometry.h);
+}
+
+void DisplayScreen::LayoutSquare()
+{
+    vector<FrameViewer *> active = ActiveViewers();
+    int num_channels = active.size();
 
-        FrameViewer *viewer = new FrameViewer(this);
+    // NxN layout
+    int mode = std::max(1, (int)ceil(sqrt(num_channels)));
 
-        viewer->SetGeometry(cg.x, cg.y, cg.w, cg.h);
-        viewer->SetIdx(idx++); // set id for parent to distinguish
-        this->AddViewer(viewer);
+    int geo_w, geo_h;
+    geo_w = int((layout_w_) / mode);
+    geo_w &= (~0x1f); // sws_scale needs width to be 32x
+    geo_h = int((layout_h_) / mode);
+    geo_h = (geo_w * 9) / 16;
+
+    for (int i = 0; i < num_channels; i++)
+    {
+        int x = (i % mode) * geo_w;
+        int y = ((i / mode) * (geo_h));
+        ViewerGeometry cg = {x, y, geo_w, geo_h};
+        PlaceViewer(active[i], cg);
     }
+    UpdateViewerGeometry();
+}
 
-    if (!create_exit_button)
+void DisplayScreen::UpdateViewerGeometry()
+{
+    viewer_geometry_.clear();
+    for (FrameViewer *viewer : ActiveViewers())
     {
-        QPushButton *exitButton = new QPushButton("Exit", this);
-        exitButton->setGeometry(screen_width - 60, 0, 60, 25); // FIXME
-        QObject::connect(exitButton, &QPushButton::clicked, &QCoreApplication::quit);
-        create_exit_button = true;
+        QRect rect = viewer->geometry();
+        viewer_geometry_.push_back({rect.x(), rect.y(), rect.width(), rect.height()});
     }
+    if (exit_button_)
+        exit_button_->raise();
+    // Viewers moved or left: the render worker clears their old places in the mosaic
+    lock_guard<mutex> lock(sinks_mutex_);
+    mosaic_clear_ = true;
+}
 
-    if(fullscreen)
-    this->setWindowState(Qt::WindowFullScreen);
+void DisplayScreen::SetSquareLayout(int num_channels, bool fullscreen)
+{
+    SetupWindow(fullscreen);
+    square_layout_ = true;
+    ResizeChannels(std::max(0, num_channels));
+    LayoutSquare();
+}
+
+void DisplayScreen::SetCustomLayout(const vector<ViewerGeometry> &geometry, bool fullscreen)
+{
+    SetupWindow(fullscreen);
+    square_layout_ = false;
+    ResizeChannels(geometry.size());
+    vector<FrameViewer *> active = ActiveViewers();
+    for (size_t i = 0; i < active.size(); i++)
+        PlaceViewer(active[i], geometry[i]);
+    UpdateViewerGeometry();
+}
+
+int DisplayScreen::AddChannel()
+{
+    if (layout_w_ == 0)
+        SetupWindow(true);
+    square_layout_ = true;
+    FrameViewer *viewer = AcquireViewer();
+    LayoutSquare();
+    return viewer->idx_;
+}
+
+int DisplayScreen::AddChannel(const ViewerGeometry &geometry)
+{
+    if (layout_w_ == 0)
+        SetupWindow(true);
+    square_layout_ = false;
+    FrameViewer *viewer = AcquireViewer();
+    PlaceViewer(viewer, geometry);
+    UpdateViewerGeometry();
+    return viewer->idx_;
+}
+
+void DisplayScreen::RemoveChannel(int viewer_id)
+{
+    FrameViewer *viewer = Viewer(viewer_id);
+    if (viewer == nullptr || !viewer->IsActive())
+        return;
+    viewer->SetActive(false);
+    if (square_layout_)
+        LayoutSquare();
+    else
+        UpdateViewerGeometry();
+}
+
+bool DisplayScreen::IsChannelActive(int viewer_id)
+{
+    FrameViewer *viewer = Viewer(viewer_id);
+    return viewer != nullptr && viewer->IsActive();
 }
 
 void DisplayScreen::AddViewer(QWidget *viewer)
 {
+    lock_guard<mutex> lock(viewers_mutex_);
     viewers_.push_back(viewer);
     num_viewers_ = viewers_.size();
 }
 
 uint32_t DisplayScreen::NumViewers()
 {
+    lock_guard<mutex> lock(viewers_mutex_);
     return num_viewers_;
 }
 
 FrameViewer::FrameViewer(DisplayScreen *parent = nullptr) : QWidget(parent)
 {
-    connect(this, SIGNAL(signal_UpdateFrame(cv::Mat *)), this, SLOT(slot_UpdateFrame(cv::Mat *)));
-    connect(this, SIGNAL(signal_UpdateFPS(float)), this, SLOT(slot_UpdateFPS(float)));
+    this->screen_ = parent;
+    this->scheduler_ = parent ? parent->scheduler_ : nullptr;
+    this->active_ = true;
+    this->repaint_pending_ = false;
+    this->pending_format_ = PixelFormat::RGB;
+    this->pending_fps_ = .0;
+    this->shown_fps_ = .0;
+    this->show_fps_ = true;
+    this->show_name_ = true;
+    this->overlay_renderer_ = new OverlayRenderer();
 
     this->running_ = true;
     this->display_frame_idx_ = 0;
+    this->x_ = this->y_ = this->w_ = this->h_ = 0;
 
     frame_ = new QLabel(this);
 
@@ -248,6 +799,10 @@ FrameViewer::FrameViewer(DisplayScreen *parent = nullptr) : QWidget(parent)
     fps_->setStyleSheet(LabelDefaultStyle);
     fps_->move(name_->width() - 3, count * interval);
     count++;
+
+    hud_ = new QLabel(frame_);
+    hud_->setStyleSheet(HUDStyle);
+    hud_->hide();
     // Set up the layout
     QVBoxLayout *layout = new QVBoxLayout(this);
     layout->addWidget(frame_);
@@ -259,6 +814,9 @@ FrameViewer::FrameViewer(DisplayScreen *parent = nullptr) : QWidget(parent)
 FrameViewer::~FrameViewer()
 {
     this->running_ = false;
+    if (scheduler_)
+        scheduler_->Forget(this);
+    delete overlay_renderer_;
     int size = display_frame_list_.size();
     for (int i = 0; i < size; i++)
         delete display_frame_list_[i];
@@ -266,27 +824,81 @@ FrameViewer::~FrameViewer()
 
 uint32_t FrameViewer::width()
 {
+    lock_guard<mutex> lock(pending_mutex_);
     return this->w_;
 }
 
 uint32_t FrameViewer::height()
 {
+    lock_guard<mutex> lock(pending_mutex_);
     return this->h_;
 }
 
 void FrameViewer::SetGeometry(int x, int y, int w, int h)
 {
-    x_ = x;
-    y_ = y;
-    w_ = w;
-    h_ = h;
+    {
+        lock_guard<mutex> lock(pending_mutex_);
+        x_ = x;
+        y_ = y;
+        w_ = w;
+        h_ = h;
+        // Set up display frame buffer once; after a relayout NextDisplayFrameBuf resizes each buffer
+        // when it is handed out again, so frames in flight keep their pixels
+        if (this->display_frame_list_.empty())
+        {
+            for (int i = 0; i < 60 /* FIXME */; i++)
+            {
+                cv::Mat *display_frame = new cv::Mat(h_, w_, CV_8UC3);
+                this->display_frame_list_.push_back(display_frame);
+            }
+        }
+    }
     this->setGeometry(x, y, w, h);
-    // Set up display frame buffer
-    for (int i = 0; i < 60 /* FIXME */; i++)
+}
+
+cv::Mat *FrameViewer::NextDisplayFrameBuf()
+{
+    cv::Mat *display_frame;
+    int w, h;
     {
-        cv::Mat *display_frame = new cv::Mat(h_, w_, CV_8UC3);
-        this->display_frame_list_.push_back(display_frame);
+        lock_guard<mutex> lock(pending_mutex_);
+        display_frame = display_frame_list_.at(display_frame_idx_);
+        display_frame_idx_ = (display_frame_idx_ + 1) % display_frame_list_.size();
+        w = w_;
+        h = h_;
     }
+    display_frame->create(h, w, CV_8UC3); // no-op unless the viewer was resized
+    return display_frame;
+}
+
+void FrameViewer::SetActive(bool active)
+{
+    if (active_.exchange(active) == active)
+        return;
+    if (active)
+    {
+        ResetStats();
+        show();
+        return;
+    }
+
+    // Drop whatever is waiting to be painted, the viewer may come back for another stream
+    {
+        lock_guard<mutex> lock(pending_mutex_);
+        pending_frame_.release();
+        pending_overlay_.clear();
+        repaint_pending_ = false;
+        ready_frame_.release();
+    }
+    if (scheduler_)
+        scheduler_->Forget(this);
+    frame_->clear();
+    hide();
+}
+
+bool FrameViewer::IsActive()
+{
+    return active_;
 }
 
 void FrameViewer::SetIdx(int idx)
@@ -297,32 +909,316 @@ void FrameViewer::SetIdx(int idx)
     name_->adjustSize();
 }
 
-void FrameViewer::UpdateFrame(cv::Mat *frame)
+void FrameViewer::UpdateFrame(cv::Mat *frame, PixelFormat format, vector<OverlayItem> overlay,
+                              chrono::steady_clock::time_point capture_time)
+{
+    if (!active_)
+        return;
+    bool queue;
+    {
+        lock_guard<mutex> lock(pending_mutex_);
+        // Keep a header copy: shares the pixels and keeps them alive until painted
+        pending_frame_ = *frame;
+        pending_format_ = format;
+        pending_overlay_.swap(overlay);
+        pending_submit_time_ = chrono::steady_clock::now();
+        pending_capture_time_ = capture_time;
+        stats_.frames_submitted++;
+        if (repaint_pending_)
+            stats_.frames_dropped++;
+        queue = !repaint_pending_;
+        repaint_pending_ = true;
+    }
+    if (queue)
+    {
+        if (scheduler_)
+            scheduler_->MarkDirty(this);
+        else
+            QMetaObject::invokeMethod(this, [this]() { Repaint(); }, Qt::QueuedConnection);
+    }
+}
+
+// Never render into an image the GUI thread (or a producer, when aliased) still holds
+static void ReleaseIfShared(cv::Mat &mat)
 {
-    emit signal_UpdateFrame(frame);
+    if (mat.u != nullptr && CV_XADD(&mat.u->refcount, 0) > 1)
+        mat.release();
 }
 
-void FrameViewer::slot_UpdateFrame(cv::Mat *frame)
+bool FrameViewer::Render()
 {
-    QImage img((*frame).data, (*frame).cols, (*frame).rows, (*frame).step, QImage::Format_RGB888);
+    cv::Mat frame;
+    PixelFormat format;
+    chrono::steady_clock::time_point submit_time, capture_time;
+    cv::Size display_size;
+    cv::Point origin;
+    {
+        lock_guard<mutex> lock(pending_mutex_);
+        frame = pending_frame_;
+        format = pending_format_;
+        submit_time = pending_submit_time_;
+        capture_time = pending_capture_time_;
+        overlay_.swap(pending_overlay_);
+        pending_overlay_.clear();
+        pending_frame_.release();
+        repaint_pending_ = false;
+        // The label fills the viewer, its size is known without touching the widget
+        display_size = cv::Size(w_, h_);
+        origin = cv::Point(x_, y_);
+    }
+    if (frame.empty())
+        return false;
+    auto render_start = chrono::steady_clock::now();
+
+    if (display_size.empty()) // not laid out yet
+        display_size = FrameImageSize(frame, format);
+    ConvertFrameToRGB(frame, format, display_size, display_rgb_, convert_scratch_);
+
+    cv::Mat *display = &display_rgb_;
+    if (!overlay_.empty())
+    {
+        // Never draw into the producer's pixels
+        if (display_rgb_.datastart == frame.datastart)
+        {
+            ReleaseIfShared(overlay_canvas_);
+            display_rgb_.copyTo(overlay_canvas_);
+            display = &overlay_canvas_;
+        }
+        cv::Size src_size = FrameImageSize(frame, format);
+        overlay_renderer_->Draw(*display, overlay_, (double)display->cols / src_size.width, (double)display->rows / src_size.height);
+    }
+
+    vector<shared_ptr<FrameSink>> sinks;
+    {
+        lock_guard<mutex> lock(sinks_mutex_);
+        sinks = sinks_;
+    }
+    if (!sinks.empty())
+    {
+        auto now = chrono::steady_clock::now();
+        for (auto &sink : sinks)
+            sink->OnFrame(*display, now);
+    }
+    if (screen_)
+        screen_->ComposeMosaic(origin, *display);
+
+    lock_guard<mutex> lock(pending_mutex_);
+    if (!ready_frame_.empty()) // the GUI thread did not get to the previous one
+        stats_.frames_dropped++;
+    ready_frame_ = *display;
+    ready_submit_time_ = submit_time;
+    ready_capture_time_ = capture_time;
+    ready_render_start_ = render_start;
+    return true;
+}
+
+void FrameViewer::Present()
+{
+    cv::Mat frame;
+    chrono::steady_clock::time_point submit_time, capture_time, render_start;
+    {
+        lock_guard<mutex> lock(pending_mutex_);
+        if (ready_frame_.empty())
+            return;
+        frame = ready_frame_;
+        ready_frame_.release();
+        submit_time = ready_submit_time_;
+        capture_time = ready_capture_time_;
+        render_start = ready_render_start_;
+    }
+    if (!active_)
+        return;
+
+    QImage img(frame.data, frame.cols, frame.rows, frame.step, QImage::Format_RGB888);
     // Set the QImage as the pixmap for the QLabel
     QPixmap pixmap = QPixmap::fromImage(img);
     if (pixmap.isNull()) {
         throw std::runtime_error("QtUtil error: Failed to load image.");
     // Handle the error accordingly
     }
-    frame_->setPixmap(pixmap.scaled(frame_->size(),Qt::IgnoreAspectRatio, Qt::SmoothTransformation));
+    if (pixmap.size() != frame_->size())
+        frame_->setPixmap(pixmap.scaled(frame_->size(), Qt::IgnoreAspectRatio, Qt::SmoothTransformation));
+    else
+        frame_->setPixmap(pixmap);
+    RecordPaint(submit_time, capture_time, render_start);
+}
+
+void FrameViewer::Repaint()
+{
+    if (Render())
+        Present();
+}
+
+#define StatsWindowSize 256
+
+void FrameViewer::StatsWindow::Push(double value)
+{
+    if (samples.size() < StatsWindowSize)
+        samples.push_back(value);
+    else
+        samples[pos] = value;
+    pos = (pos + 1) % StatsWindowSize;
+}
+
+void FrameViewer::RecordPaint(chrono::steady_clock::time_point submit_time, chrono::steady_clock::time_point capture_time,
+                              chrono::steady_clock::time_point paint_start)
+{
+    auto now = chrono::steady_clock::now();
+
+    lock_guard<mutex> lock(pending_mutex_);
+    stats_.frames_painted++;
+    latency_ms_.Push(chrono::duration<double, milli>(now - submit_time).count());
+    paint_ms_.Push(chrono::duration<double, milli>(now - paint_start).count());
+    if (capture_time.time_since_epoch().count() != 0)
+        capture_latency_ms_.Push(chrono::duration<double, milli>(now - capture_time).count());
+    if (last_paint_time_.time_since_epoch().count() != 0)
+        interval_ms_.Push(chrono::duration<double, milli>(now - last_paint_time_).count());
+    last_paint_time_ = now;
+}
+
+static double Percentile(const vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t idx = std::min(sorted.size() - 1, (size_t)(p * (sorted.size() - 1) + 0.5));
+    return sorted[idx];
+}
+
+ViewerStats FrameViewer::GetStats()
+{
+    ViewerStats stats;
+    vector<double> latency, capture_latency, interval, paint;
+    {
+        lock_guard<mutex> lock(pending_mutex_);
+        stats = stats_;
+        latency = latency_ms_.samples;
+        capture_latency = capture_latency_ms_.samples;
+        interval = interval_ms_.samples;
+        paint = paint_ms_.samples;
+    }
+
+    std::sort(latency.begin(), latency.end());
+    stats.latency_p50_ms = Percentile(latency, 0.50);
+    stats.latency_p90_ms = Percentile(latency, 0.90);
+    stats.latency_p99_ms = Percentile(latency, 0.99);
+    stats.latency_max_ms = latency.empty() ? 0 : latency.back();
+
+    std::sort(capture_latency.begin(), capture_latency.end());
+    stats.capture_latency_p50_ms = Percentile(capture_latency, 0.50);
+    stats.capture_latency_p99_ms = Percentile(capture_latency, 0.99);
+
+    if (!interval.empty())
+    {
+        double sum = 0, sq_sum = 0;
+        for (double v : interval)
+        {
+            sum += v;
+            sq_sum += v * v;
+        }
+        double mean = sum / interval.size();
+        stats.frame_interval_ms = mean;
+        stats.frame_jitter_ms = std::sqrt(std::max(0.0, sq_sum / interval.size() - mean * mean));
+        stats.paint_fps = (mean > 0) ? 1000.0 / mean : 0;
+    }
+
+    if (!paint.empty())
+    {
+        double sum = 0;
+        for (double v : paint)
+        {
+            sum += v;
+            stats.paint_time_max_ms = std::max(stats.paint_time_max_ms, v);
+        }
+        stats.paint_time_avg_ms = sum / paint.size();
+    }
+    return stats;
+}
+
+void FrameViewer::ResetStats()
+{
+    lock_guard<mutex> lock(pending_mutex_);
+    stats_ = ViewerStats();
+    latency_ms_ = StatsWindow();
+    capture_latency_ms_ = StatsWindow();
+    interval_ms_ = StatsWindow();
+    paint_ms_ = StatsWindow();
+    last_paint_time_ = chrono::steady_clock::time_point();
+}
+
+void FrameViewer::AddSink(shared_ptr<FrameSink> sink)
+{
+    lock_guard<mutex> lock(sinks_mutex_);
+    sinks_.push_back(sink);
+}
+
+void FrameViewer::RemoveSink(shared_ptr<FrameSink> sink)
+{
+    lock_guard<mutex> lock(sinks_mutex_);
+    sinks_.erase(std::remove(sinks_.begin(), sinks_.end(), sink), sinks_.end());
+}
+
+void FrameViewer::ShowHUD(bool show)
+{
+    hud_->setVisible(show);
+    if (show)
+        RefreshLabels();
+}
+
+bool FrameViewer::HUDVisible()
+{
+    return !hud_->isHidden();
+}
+
+void FrameViewer::slot_UpdateFrame(cv::Mat *frame)
+{
+    UpdateFrame(frame);
 }
 
 void FrameViewer::UpdateFPS(float fps)
 {
-    emit signal_UpdateFPS(fps);
+    lock_guard<mutex> lock(pending_mutex_);
+    pending_fps_ = fps;
+}
+
+void FrameViewer::RefreshLabels()
+{
+    float fps;
+    bool show_fps, show_name;
+    {
+        lock_guard<mutex> lock(pending_mutex_);
+        fps = pending_fps_;
+        show_fps = show_fps_;
+        show_name = show_name_;
+    }
+    if (name_->isHidden() == show_name)
+        name_->setVisible(show_name);
+    if (fps_->isHidden() == show_fps)
+        fps_->setVisible(show_fps);
+    if (show_fps && fps != shown_fps_)
+        slot_UpdateFPS(fps);
+
+    if (!hud_->isHidden())
+    {
+        ViewerStats stats = GetStats();
+        QString text = QString::asprintf("paint %.1f fps  drop %llu/%llu\n"
+                                         "lat p50 %.1f  p99 %.1f ms\n"
+                                         "cap p50 %.1f  p99 %.1f ms\n"
+                                         "jitter %.2f ms  paint %.2f ms",
+                                         stats.paint_fps, (unsigned long long)stats.frames_dropped, (unsigned long long)stats.frames_submitted,
+                                         stats.latency_p50_ms, stats.latency_p99_ms,
+                                         stats.capture_latency_p50_ms, stats.capture_latency_p99_ms,
+                                         stats.frame_jitter_ms, stats.paint_time_avg_ms);
+        hud_->setText(text);
+        hud_->adjustSize();
+        hud_->move(0, frame_->height() - hud_->height());
+    }
 }
 
 void FrameViewer::slot_UpdateFPS(float fps)
 {
     if (fps == .0)
         return;
+    shown_fps_ = fps;
     fps_->move(name_->width() - 3, 0);
     fps_->setText("FPS = " + QString::number(fps, 'f', 1));
     fps_->adjustSize();
@@ -330,10 +1226,12 @@ void FrameViewer::slot_UpdateFPS(float fps)
 
 void FrameViewer::HideFPS()
 {
-    this->fps_->hide();
+    lock_guard<mutex> lock(pending_mutex_);
+    show_fps_ = false;
 }
 
 void FrameViewer::HideChannelName()
 {
-    this->name_->hide();
+    lock_guard<mutex> lock(pending_mutex_);
+    show_name_ = false;
 }
@@ -15,13 +15,127 @@
 #include <QScreen>
 #include <QMenu>
 #include <QAction>
+#include <QResizeEvent>
 
 #include <opencv2/opencv.hpp>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <map>
 
 using namespace std;
 
+class FrameViewer;
+class DisplayScreen;
+class OverlayRenderer;
+class RecordingSink;
+class MjpegServer;
+class RenderWorker;
+
+/**
+ * @brief Pixel layout of a frame passed to SetDisplayFrame.
+ *
+ * Frames are resampled to the viewer size before they are converted to RGB,
+ * so producers can hand over decoded frames without a full-resolution cvtColor.
+ */
+enum class PixelFormat
+{
+    RGB,  ///< CV_8UC3, the default
+    BGR,  ///< CV_8UC3
+    BGRA, ///< CV_8UC4
+    NV12, ///< CV_8UC1 of (h * 3 / 2) rows: Y plane followed by the interleaved UV plane
+    I420  ///< CV_8UC1 of (h * 3 / 2) rows: Y plane followed by the U and V planes, continuous
+};
+
+/**
+ * @brief A detection drawn on top of a displayed frame.
+ *
+ * Overlays are rendered at display resolution while the frame is composited,
+ * so the source frame is never modified.
+ */
+struct OverlayItem
+{
+    cv::Rect2f box;                             ///< Bounding box in source frame pixels
+    string label;                               ///< Text shown on the box tag, may be empty
+    float score = -1.f;                         ///< Appended to the label when not negative
+    cv::Scalar color = cv::Scalar(20, 255, 57); ///< Box color in RGB order
+    cv::Mat mask;                               ///< Optional CV_8UC1 mask stretched over `box`, non-zero pixels are tinted
+};
+
+/**
+ * @brief Display statistics of a viewer, see DisplayScreen::GetViewerStats.
+ *
+ * Percentiles, rates and jitter are computed over the most recent painted frames.
+ */
+struct ViewerStats
+{
+    uint64_t frames_submitted = 0;     ///< Frames handed to SetDisplayFrame
+    uint64_t frames_painted = 0;       ///< Frames that reached the screen
+    uint64_t frames_dropped = 0;       ///< Frames replaced by a newer one before they were painted
+    double paint_fps = 0;              ///< Achieved paint rate
+    double latency_p50_ms = 0;         ///< Submit to paint latency percentiles
+    double latency_p90_ms = 0;
+    double latency_p99_ms = 0;
+    double latency_max_ms = 0;
+    double capture_latency_p50_ms = 0; ///< Capture to paint latency, for frames submitted with a capture time
+    double capture_latency_p99_ms = 0;
+    double frame_interval_ms = 0;      ///< Mean time between two painted frames
+    double frame_jitter_ms = 0;        ///< Standard deviation of the time between two painted frames
+    double paint_time_avg_ms = 0;      ///< Time from the start of rendering a frame until it is presented
+    double paint_time_max_ms = 0;
+};
+
+/**
+ * @brief FrameSink receives the frames of a viewer, or the screen mosaic, as they are presented.
+ *
+ * Sinks are called on the thread compositing the frame and must return quickly. The
+ * RGB888 image is only valid for the duration of the call.
+ */
+class FrameSink
+{
+public:
+    virtual ~FrameSink() {}
+    virtual void OnFrame(const cv::Mat &rgb, chrono::steady_clock::time_point time) = 0;
+};
+
+/**
+ * @brief What a recording does when its encoder falls behind and the queue is full.
+ */
+enum class RecordingDropPolicy
+{
+    DropNewest, ///< Discard the incoming frame, the display path never waits
+    DropOldest, ///< Discard the oldest queued frame, the display path never waits
+    Block       ///< Wait for the encoder, stalls the display; for offline capture only
+};
+
+/**
+ * @brief Settings of a recording started with DisplayScreen::StartRecording.
+ */
+struct RecordingConfig
+{
+    string path;                ///< Output file for VideoWriter, or the path prefix of raw segments
+    bool raw = false;           ///< Write raw RGB segments instead of encoding with cv::VideoWriter
+    int fourcc = cv::VideoWriter::fourcc('M', 'J', 'P', 'G'); ///< Codec for cv::VideoWriter
+    double fps = 30;            ///< Frame rate written into the container
+    size_t queue_depth = 8;     ///< Frames buffered between the display path and the encoder
+    RecordingDropPolicy drop_policy = RecordingDropPolicy::DropNewest;
+    size_t segment_frames = 900; ///< Frames per raw segment file
+};
+
+/**
+ * @brief Counters of a recording, see DisplayScreen::GetRecordingStats.
+ */
+struct RecordingStats
+{
+    uint64_t frames_enqueued = 0;
+    uint64_t frames_written = 0;
+    uint64_t frames_dropped = 0;
+    double enqueue_avg_us = 0; ///< Time added to the display path per frame
+    double enqueue_max_us = 0;
+};
+
 struct ViewerGeometry
 {
     int x;
@@ -30,6 +144,61 @@ struct ViewerGeometry
     int h;
 };
 
+/**
+ * @brief RepaintScheduler coalesces viewer repaints to the refresh rate of a screen.
+ *
+ * Producers may submit frames and FPS numbers at any rate from any thread; the
+ * scheduler collects the dirty viewers and hands each of them at most once per
+ * display refresh to the render worker of the screen. FPS labels are refreshed at a
+ * few Hz only.
+ */
+class RepaintScheduler : public QObject
+{
+    Q_OBJECT
+
+public:
+    RepaintScheduler(DisplayScreen *screen, QScreen *qscreen);
+    ~RepaintScheduler();
+
+    /**
+     * @brief Queues a viewer for repaint on the next tick. Thread-safe.
+     * @param viewer The viewer holding a new pending frame.
+     */
+    void MarkDirty(FrameViewer *viewer);
+
+    /**
+     * @brief Drops a viewer from the pending repaint list, e.g. before it is deleted.
+     * @param viewer The viewer to forget.
+     */
+    void Forget(FrameViewer *viewer);
+
+    /**
+     * @brief Sets the tick rate of the scheduler.
+     * @param refresh_rate The display refresh rate in Hz. Non-positive values fall back to 60 Hz.
+     */
+    void SetRefreshRate(qreal refresh_rate);
+
+    /**
+     * @brief Sets how often the FPS labels of the viewers are refreshed.
+     * @param label_rate The label refresh rate in Hz.
+     */
+    void SetLabelRate(qreal label_rate);
+
+private slots:
+    void slot_Tick();
+
+private:
+    DisplayScreen *screen_;
+    QTimer timer_;
+    qreal refresh_rate_;
+    qreal label_rate_;
+    int label_interval_ticks_;
+    int ticks_since_labels_;
+    mutex dirty_mutex_;
+    vector<FrameViewer *> dirty_viewers_;
+    vector<FrameViewer *> tick_viewers_;
+};
+
 /**
  * @brief DisplayScreen handles multiple FrameViewers.
  * That is, a screen may display multiple streaming channels.
@@ -40,13 +209,55 @@ class DisplayScreen : public QWidget
 
 private:
     bool running_ = false;
+    bool headless_ = false;
     friend class FrameViewer;
+    friend class RepaintScheduler;
+    friend class RenderWorker;
+    friend class MxQt;
     uint32_t w_, h_;
     uint32_t num_viewers_;
+    // Only the GUI thread adds viewers; other threads look them up under viewers_mutex_.
+    // Viewers are never deleted before the screen, removed channels are parked for reuse.
+    mutex viewers_mutex_;
     vector<QWidget *> viewers_;
     vector<ViewerGeometry> viewer_geometry_;
+    RepaintScheduler *scheduler_;
+    FrameViewer *Viewer(int viewer_id);
+
+    // Layout state, GUI thread only
+    bool square_layout_ = true;
+    int layout_w_ = 0, layout_h_ = 0;
+    QPushButton *exit_button_ = nullptr;
+    void SetupWindow(bool fullscreen);
+    vector<FrameViewer *> ActiveViewers();
+    FrameViewer *AcquireViewer();
+    void ResizeChannels(size_t num_channels);
+    void PlaceViewer(FrameViewer *viewer, const ViewerGeometry &geometry);
+    void LayoutSquare();
+    void UpdateViewerGeometry();
     void showInferencePopUpMenu(const QPoint &pos);
 
+    // Rendering runs on the worker, the GUI thread only presents the finished images
+    RenderWorker *render_worker_;
+    mutex present_mutex_;
+    vector<FrameViewer *> present_viewers_;
+    vector<FrameViewer *> presenting_viewers_;
+    void QueuePresent(FrameViewer *viewer);
+    void PresentReady();
+
+    mutex sinks_mutex_;
+    map<int, shared_ptr<RecordingSink>> recordings_;
+    vector<shared_ptr<FrameSink>> mosaic_sinks_;
+    cv::Size mosaic_size_;      // guarded by sinks_mutex_
+    bool mosaic_clear_ = false; // guarded by sinks_mutex_
+    cv::Mat mosaic_;            // render worker only
+    bool mosaic_dirty_ = false;
+    void ComposeMosaic(cv::Point origin, const cv::Mat &rgb);
+    void FlushMosaic();
+
+protected:
+    void resizeEvent(QResizeEvent *event) override;
+
 public:
     DisplayScreen();
     DisplayScreen(QWidget *parent, QScreen *qscreen);
@@ -87,6 +298,68 @@ public:
      */
     void SetDisplayFrame(int viewer_id, cv::Mat frame);
 
+    /**
+     * @brief Sets the frame context to be displayed for a viewer, given in a specific pixel format.
+     *
+     * The frame is resampled to the viewer size and converted to RGB at display time,
+     * so only the displayed pixels are converted.
+     *
+     * @param viewer_id The index of the viewer.
+     * @param frame The frame context represented by a cv::Mat* object.
+     * @param format The pixel format of the frame.
+     * @param fps The FPS number to be shown on the screen.
+     */
+    void SetDisplayFrame(int viewer_id, cv::Mat *frame, PixelFormat format, float fps);
+
+    /**
+     * @brief Sets the frame context to be displayed for a viewer, given in a specific pixel format, without displaying the FPS number.
+     *
+     * @param viewer_id The index of the viewer.
+     * @param frame The frame context represented by a cv::Mat* object.
+     * @param format The pixel format of the frame.
+     */
+    void SetDisplayFrame(int viewer_id, cv::Mat *frame, PixelFormat format);
+
+    /**
+     * @brief Sets the frame context and the detections to be drawn on it for a viewer.
+     *
+     * The overlay belongs to this frame only and is drawn at display resolution,
+     * leaving the source frame untouched.
+     *
+     * @param viewer_id The index of the viewer.
+     * @param frame The frame context represented by a cv::Mat* object.
+     * @param format The pixel format of the frame.
+     * @param overlay The boxes, labels, scores, colors and masks in source frame coordinates.
+     * @param fps The FPS number to be shown on the screen.
+     */
+    void SetDisplayFrame(int viewer_id, cv::Mat *frame, PixelFormat format, vector<OverlayItem> overlay, float fps);
+
+    /**
+     * @brief Sets the frame context and the detections to be drawn on it for a viewer, without displaying the FPS number.
+     *
+     * @param viewer_id The index of the viewer.
+     * @param frame The frame context represented by a cv::Mat* object.
+     * @param format The pixel format of the frame.
+     * @param overlay The boxes, labels, scores, colors and masks in source frame coordinates.
+     */
+    void SetDisplayFrame(int viewer_id, cv::Mat *frame, PixelFormat format, vector<OverlayItem> overlay);
+
+    /**
+     * @brief Sets the frame context to be displayed for a viewer, together with the time it was captured.
+     *
+     * The capture time feeds the capture to paint latency in ViewerStats, which
+     * separates upstream (decode, inference, queuing) delay from display delay.
+     *
+     * @param viewer_id The index of the viewer.
+     * @param frame The frame context represented by a cv::Mat* object.
+     * @param format The pixel format of the frame.
+     * @param overlay The detections to draw, may be empty.
+     * @param fps The FPS number to be shown on the screen, 0 leaves the label unchanged.
+     * @param capture_time When the frame was captured, on the steady clock.
+     */
+    void SetDisplayFrame(int viewer_id, cv::Mat *frame, PixelFormat format, vector<OverlayItem> overlay, float fps,
+                         chrono::steady_clock::time_point capture_time);
+
     /**
      * @brief Retrieves the frame context buffer to be displayed for a viewer.
      * @param viewer_id The index of the viewer.
@@ -94,6 +367,67 @@ public:
      */
     cv::Mat *GetDisplayFrameBuf(int viewer_id);
 
+    /**
+     * @brief Retrieves the display statistics of a viewer.
+     * @param viewer_id The index of the viewer.
+     * @return Frame counters, paint rate and submit to paint latency of the viewer.
+     */
+    ViewerStats GetViewerStats(int viewer_id);
+
+    /**
+     * @brief Clears the display statistics of a viewer.
+     * @param viewer_id The index of the viewer.
+     */
+    void ResetViewerStats(int viewer_id);
+
+    /**
+     * @brief Shows or hides the on-screen statistics HUD of the viewers.
+     *
+     * The HUD can also be toggled from the right-click menu of the screen.
+     *
+     * @param show Whether the HUD is visible.
+     * @param viewer_id The index of the viewer, or -1 for all viewers.
+     */
+    void ShowStatsHUD(bool show, int viewer_id = -1);
+
+    /**
+     * @brief Attaches a sink that receives every frame presented by a viewer.
+     * @param viewer_id The index of the viewer, or -1 for the composited screen mosaic.
+     * @param sink The sink to attach.
+     */
+    void AddFrameSink(int viewer_id, shared_ptr<FrameSink> sink);
+
+    /**
+     * @brief Detaches a sink previously attached with AddFrameSink.
+     * @param viewer_id The index of the viewer, or -1 for the composited screen mosaic.
+     * @param sink The sink to detach.
+     */
+    void RemoveFrameSink(int viewer_id, shared_ptr<FrameSink> sink);
+
+    /**
+     * @brief Starts recording what a viewer, or the whole screen, displays.
+     *
+     * Frames are copied into a bounded queue and encoded by a background thread pool,
+     * so the display path only pays for one copy at display resolution.
+     *
+     * @param viewer_id The index of the viewer, or -1 for the composited screen mosaic.
+     * @param config Output, queue and drop policy settings.
+     * @return false if a recording of this viewer is already running.
+     */
+    bool StartRecording(int viewer_id, const RecordingConfig &config);
+
+    /**
+     * @brief Stops a recording, writes out the queued frames and closes the output.
+     * @param viewer_id The index of the viewer, or -1 for the composited screen mosaic.
+     */
+    void StopRecording(int viewer_id);
+
+    /**
+     * @brief Retrieves the counters of a running recording.
+     * @param viewer_id The index of the viewer, or -1 for the composited screen mosaic.
+     */
+    RecordingStats GetRecordingStats(int viewer_id);
+
     /**
      * @brief Retrieves the width of the display.
      *
@@ -136,15 +470,65 @@ public:
      * @brief Sets a square layout for the viewers.
      *
      * This function arranges the viewers in a square layout based on the number of channels specified.
+     * It may be called again at any time: existing viewers and their frame buffers are reused and
+     * only moved, extra channels are removed starting from the highest index.
      *
      * @param num_channels The number of channels to be displayed in the square layout.
      */
     void SetSquareLayout(int num_channels, bool fullscreen = true);
 
+    /**
+     * @brief Places the channels at explicit positions.
+     *
+     * Channel i, in increasing viewer index order, is placed at geometry[i]. As with SetSquareLayout,
+     * viewers are reused and channels are added or removed to match the number of entries.
+     *
+     * @param geometry Position and size of each channel, in screen pixels.
+     */
+    void SetCustomLayout(const vector<ViewerGeometry> &geometry, bool fullscreen = true);
+
+    /**
+     * @brief Adds a channel and re-arranges all channels in the square layout.
+     *
+     * The other channels keep streaming while they are moved.
+     * Must be called from the GUI thread, e.g. through QMetaObject::invokeMethod.
+     *
+     * @return The viewer index of the new channel, the lowest index of a removed channel if any.
+     */
+    int AddChannel();
+
+    /**
+     * @brief Adds a channel at an explicit position, leaving the other channels where they are.
+     *
+     * Must be called from the GUI thread.
+     *
+     * @param geometry Position and size of the new channel, in screen pixels.
+     * @return The viewer index of the new channel.
+     */
+    int AddChannel(const ViewerGeometry &geometry);
+
+    /**
+     * @brief Removes a channel from the screen.
+     *
+     * The viewer is hidden and kept for a later AddChannel, so buffers obtained from
+     * GetDisplayFrameBuf stay valid; frames still submitted to it are ignored. In the square
+     * layout the remaining channels are re-arranged. Must be called from the GUI thread.
+     *
+     * @param viewer_id The index of the viewer.
+     */
+    void RemoveChannel(int viewer_id);
+
+    /**
+     * @brief Tells whether a viewer index belongs to a channel currently on the screen.
+     * @param viewer_id The index of the viewer.
+     */
+    bool IsChannelActive(int viewer_id);
+
     /**
      * @brief Retrieves the number of viewers.
      *
-     * This function returns the total number of viewers currently managed by this screen.
+     * This function returns the total number of viewers currently managed by this screen,
+     * including removed channels. Valid viewer indices are 0 to NumViewers() - 1.
      *
      * @return The number of viewers.
      */
@@ -186,20 +570,88 @@ public:
     uint32_t height();
     void SetGeometry(int x, int y, int w, int h);
     void SetIdx(int idx);
-    void UpdateFrame(cv::Mat *frame);
+
+    // Removed channels are inactive: hidden, and frames submitted to them are dropped.
+    void SetActive(bool active);
+    bool IsActive();
+
+    // Next buffer of the display ring, resized to the current viewer size when handed out. Thread-safe.
+    cv::Mat *NextDisplayFrameBuf();
+
+    // Thread-safe, only record the latest value; painting is done by the RepaintScheduler.
+    void UpdateFrame(cv::Mat *frame, PixelFormat format = PixelFormat::RGB, vector<OverlayItem> overlay = {},
+                     chrono::steady_clock::time_point capture_time = {});
     void UpdateFPS(float fps);
     void HideFPS();
     void HideChannelName();
 
-signals:
-    void signal_UpdateFrame(cv::Mat *);
-    void signal_UpdateFPS(float);
+    // Render worker: takes the pending frame and renders it, returns true when an image is ready to present.
+    bool Render();
+    // GUI thread only: Present shows the rendered image, Repaint renders and presents in place.
+    void Present();
+    void Repaint();
+    void RefreshLabels();
+
+    ViewerStats GetStats();
+    void ResetStats();
+    void AddSink(shared_ptr<FrameSink> sink);
+    void RemoveSink(shared_ptr<FrameSink> sink);
+    void ShowHUD(bool show);
+    bool HUDVisible();
 
 public slots:
     void slot_UpdateFrame(cv::Mat *frame);
     void slot_UpdateFPS(float);
 
 private:
+    DisplayScreen *screen_;
+    RepaintScheduler *scheduler_;
+    atomic<bool> active_;
+    mutex sinks_mutex_;
+    vector<shared_ptr<FrameSink>> sinks_;
+    mutex pending_mutex_;
+    cv::Mat pending_frame_;
+    PixelFormat pending_format_;
+    vector<OverlayItem> pending_overlay_;
+    chrono::steady_clock::time_point pending_submit_time_;
+    chrono::steady_clock::time_point pending_capture_time_;
+    bool repaint_pending_;
+    float pending_fps_;
+    float shown_fps_;
+    bool show_fps_;
+    bool show_name_;
+
+    // Most recent samples of one statistic
+    struct StatsWindow
+    {
+        vector<double> samples;
+        size_t pos = 0;
+        void Push(double value);
+    };
+
+    // Statistics of the most recent painted frames, guarded by pending_mutex_
+    ViewerStats stats_;
+    StatsWindow latency_ms_;
+    StatsWindow capture_latency_ms_;
+    StatsWindow interval_ms_;
+    StatsWindow paint_ms_;
+    chrono::steady_clock::time_point last_paint_time_;
+    void RecordPaint(chrono::steady_clock::time_point submit_time, chrono::steady_clock::time_point capture_time,
+                     chrono::steady_clock::time_point paint_start);
+    QLabel *hud_;
+
+    // Rendered image waiting to be presented, guarded by pending_mutex_
+    cv::Mat ready_frame_;
+    chrono::steady_clock::time_point ready_submit_time_;
+    chrono::steady_clock::time_point ready_capture_time_;
+    chrono::steady_clock::time_point ready_render_start_;
+
+    // Owned by the thread running Render
+    cv::Mat display_rgb_;
+    cv::Mat convert_scratch_;
+    cv::Mat overlay_canvas_;
+    vector<OverlayItem> overlay_;
+    OverlayRenderer *overlay_renderer_;
     int x_, y_, w_, h_;
     QLabel *frame_;
     QLabel *name_;
@@ -219,6 +671,21 @@ public:
      */
     MxQt(int &argc, char *argv[]);
 
+    /**
+     * @brief Initialization of screens, optionally without a physical display.
+     *
+     * In headless mode Qt runs on its offscreen platform and a single virtual screen of
+     * the given size is created. The SetDisplayFrame/GetDisplayFrameBuf API is unchanged;
+     * use StartStreaming to watch the output.
+     *
+     * @param argc argument count passed to main() in C/C++
+     * @param argv argument vector passed to main() in C/C++
+     * @param headless Run without a physical display
+     * @param width Width of the virtual screen in headless mode
+     * @param height Height of the virtual screen in headless mode
+     */
+    MxQt(int &argc, char *argv[], bool headless, int width = 1920, int height = 1080);
+
     // Desctructor
     ~MxQt();
 
@@ -227,6 +694,25 @@ public:
      */
     int Run();
 
+    /**
+     * @brief Serves every viewer and every screen mosaic as MJPEG over HTTP.
+     *
+     * Frames are encoded once per stream and shared by all clients, and not encoded at all
+     * while nobody is connected. Slow clients skip frames instead of blocking producers.
+     * Try it with `curl http://127.0.0.1:<port>/` to list the streams.
+     *
+     * @param port TCP port to listen on
+     * @param jpeg_quality JPEG quality, 0-100
+     * @param bind_address Address to listen on, localhost by default
+     * @return false if the server could not listen on the port
+     */
+    bool StartStreaming(uint16_t port = 8080, int jpeg_quality = 80, const string &bind_address = "127.0.0.1");
+
+    /**
+     * @brief Stops the MJPEG server and disconnects all clients.
+     */
+    void StopStreaming();
+
     /**
      * @brief Number of total available screens
      */
@@ -238,5 +724,9 @@ public:
     vector<DisplayScreen *> screens;
 
 private:
+    // Declared before app: selects the Qt platform before QApplication is constructed
+    bool headless_;
     QApplication app;
+    MjpegServer *stream_server_ = nullptr;
+    void InitScreens(int width, int height);
 };
@@ -0,0 +1,346 @@
+#include "mjpeg_server.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MjpegBoundary "mxframe"
+#define MjpegSendTimeoutSec 2
+#define MjpegRequestMaxBytes 4096
+#define MjpegAcceptBackoffMs 100
+
+MjpegStream::MjpegStream(int quality) : quality_(quality), clients_(0)
+{
+    latest_pending_ = false;
+    closed_ = false;
+    jpeg_seq_ = 0;
+    encoder_ = std::thread(&MjpegStream::Encoder, this);
+}
+
+MjpegStream::~MjpegStream()
+{
+    Close();
+    encoder_.join();
+}
+
+void MjpegStream::OnFrame(const cv::Mat &rgb, chrono::steady_clock::time_point)
+{
+    // Nobody watching: no copy, no encode
+    if (clients_.load(std::memory_order_relaxed) == 0)
+        return;
+    {
+        lock_guard<mutex> lock(mutex_);
+        rgb.copyTo(latest_);
+        latest_pending_ = true;
+    }
+    frame_cv_.notify_one();
+}
+
+void MjpegStream::AddClient()
+{
+    clients_++;
+}
+
+int MjpegStream::RemoveClient()
+{
+    return --clients_;
+}
+
+void MjpegStream::Encoder()
+{
+    cv::Mat work, bgr;
+    vector<int> params = {cv::IMWRITE_JPEG_QUALITY, quality_};
+    while (true)
+    {
+        {
+            unique_lock<mutex> lock(mutex_);
+            frame_cv_.wait(lock, [this]() { return closed_ || latest_pending_; });
+            if (closed_)
+                return;
+            // Take the latest frame, the producer gets the old buffer back
+            cv::swap(work, latest_);
+            latest_pending_ = false;
+        }
+
+        auto jpeg = make_shared<vector<uchar>>();
+        cv::cvtColor(work, bgr, cv::COLOR_RGB2BGR);
+        cv::imencode(".jpg", bgr, *jpeg, params);
+
+        {
+            lock_guard<mutex> lock(mutex_);
+            jpeg_ = jpeg;
+            jpeg_seq_++;
+        }
+        jpeg_cv_.notify_all();
+    }
+}
+
+shared_ptr<const vector<uchar>> MjpegStream::WaitJpeg(uint64_t &seq, chrono::milliseconds timeout)
+{
+    unique_lock<mutex> lock(mutex_);
+    if (!jpeg_cv_.wait_for(lock, timeout, [&]() { return closed_ || jpeg_seq_ > seq; }) || closed_)
+        return nullptr;
+    seq = jpeg_seq_;
+    return jpeg_;
+}
+
+void MjpegStream::Close()
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        closed_ = true;
+    }
+    frame_cv_.notify_all();
+    jpeg_cv_.notify_all();
+}
+
+MjpegServer::MjpegServer(const vector<DisplayScreen *> &screens, int quality) : screens_(screens), quality_(quality), running_(false)
+{
+    listen_fd_ = -1;
+    active_clients_ = 0;
+}
+
+MjpegServer::~MjpegServer()
+{
+    Stop();
+}
+
+bool MjpegServer::Start(const string &bind_address, uint16_t port)
+{
+    if (running_)
+        return false;
+
+    listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd_ < 0)
+        return false;
+    int reuse = 1;
+    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, bind_address.c_str(), &addr.sin_addr) != 1 ||
+        bind(listen_fd_, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd_, 16) != 0)
+    {
+        close(listen_fd_);
+        listen_fd_ = -1;
+        return false;
+    }
+
+    running_ = true;
+    acceptor_ = std::thread(&MjpegServer::AcceptLoop, this);
+    return true;
+}
+
+void MjpegServer::Stop()
+{
+    if (!running_.exchange(false))
+        return;
+
+    shutdown(listen_fd_, SHUT_RDWR);
+    close(listen_fd_);
+    acceptor_.join();
+
+    unique_lock<mutex> lock(mutex_);
+    for (auto &stream : streams_)
+        stream.second->Close();
+    for (int fd : client_fds_)
+        shutdown(fd, SHUT_RDWR);
+    clients_cv_.wait(lock, [this]() { return active_clients_ == 0; });
+
+    for (auto &stream : streams_)
+    {
+        int screen_id = stream.first.first, viewer_id = stream.first.second;
+        DisplayScreen *screen = screens_[screen_id];
+        shared_ptr<FrameSink> sink = stream.second;
+        QMetaObject::invokeMethod(screen, [screen, viewer_id, sink]() { screen->RemoveFrameSink(viewer_id, sink); }, Qt::QueuedConnection);
+    }
+    streams_.clear();
+}
+
+void MjpegServer::AcceptLoop()
+{
+    while (running_)
+    {
+        int fd = accept(listen_fd_, nullptr, nullptr);
+        if (fd < 0)
+        {
+            // E.g. out of file descriptors: back off instead of spinning until one is freed
+            if (errno != EINTR && running_)
+                std::this_thread::sleep_for(chrono::milliseconds(MjpegAcceptBackoffMs));
+            continue;
+        }
+
+        timeval timeout = {MjpegSendTimeoutSec, 0};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        {
+            lock_guard<mutex> lock(mutex_);
+            if (!running_)
+            {
+                close(fd);
+                break;
+            }
+            client_fds_.push_back(fd);
+            active_clients_++;
+        }
+        std::thread(&MjpegServer::ServeClient, this, fd).detach();
+    }
+}
+
+shared_ptr<MjpegStream> MjpegServer::AcquireStream(int screen_id, int viewer_id)
+{
+    lock_guard<mutex> lock(mutex_);
+    auto key = make_pair(screen_id, viewer_id);
+    auto it = streams_.find(key);
+    if (it != streams_.end())
+    {
+        it->second->AddClient();
+        return it->second;
+    }
+
+    auto stream = make_shared<MjpegStream>(quality_);
+    stream->AddClient();
+    streams_[key] = stream;
+    // Viewers belong to the GUI thread, attach from there
+    DisplayScreen *screen = screens_[screen_id];
+    shared_ptr<FrameSink> sink = stream;
+    QMetaObject::invokeMethod(screen, [screen, viewer_id, sink]() { screen->AddFrameSink(viewer_id, sink); }, Qt::QueuedConnection);
+    return stream;
+}
+
+void MjpegServer::ReleaseStream(int screen_id, int viewer_id, const shared_ptr<MjpegStream> &stream)
+{
+    lock_guard<mutex> lock(mutex_);
+    if (stream->RemoveClient() > 0)
+        return;
+    auto it = streams_.find(make_pair(screen_id, viewer_id));
+    if (it == streams_.end() || it->second != stream)
+        return;
+    // Last client gone: detach, so the viewer (or the mosaic composition) stops feeding it
+    streams_.erase(it);
+    stream->Close();
+    DisplayScreen *screen = screens_[screen_id];
+    shared_ptr<FrameSink> sink = stream;
+    QMetaObject::invokeMethod(screen, [screen, viewer_id, sink]() { screen->RemoveFrameSink(viewer_id, sink); }, Qt::QueuedConnection);
+}
+
+static bool SendAll(int fd, const void *data, size_t len)
+{
+    const char *p = (const char *)data;
+    while (len > 0)
+    {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool SendText(int fd, const string &status, const string &content_type, const string &body)
+{
+    string response = "HTTP/1.0 " + status + "\r\nContent-Type: " + content_type + "\r\nContent-Length: " +
+                      std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+    return SendAll(fd, response.data(), response.size());
+}
+
+void MjpegServer::ServeClient(int fd)
+{
+    // Request line only, headers are ignored
+    string request;
+    char buf[512];
+    while (request.find("\r\n\r\n") == string::npos && request.size() < MjpegRequestMaxBytes)
+    {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0)
+            break;
+        request.append(buf, n);
+    }
+
+    char method[8] = {0}, path[256] = {0};
+    sscanf(request.c_str(), "%7s %255s", method, path);
+    string route = path;
+    bool snapshot = route.size() > 4 && route.compare(route.size() - 4, 4, ".jpg") == 0;
+    if (snapshot)
+        route.resize(route.size() - 4);
+
+    int screen_id = -1, viewer_id = -1, consumed = 0;
+    bool valid = false;
+    if (sscanf(route.c_str(), "/screen/%d/viewer/%d%n", &screen_id, &viewer_id, &consumed) == 2 && (size_t)consumed == route.size())
+        valid = viewer_id >= 0;
+    else if (sscanf(route.c_str(), "/screen/%d%n", &screen_id, &consumed) == 1 && (size_t)consumed == route.size())
+    {
+        valid = true;
+        viewer_id = -1;
+    }
+    if (valid)
+        valid = screen_id >= 0 && screen_id < (int)screens_.size() &&
+                viewer_id < (int)screens_[screen_id]->NumViewers();
+
+    if (strcmp(method, "GET") != 0)
+    {
+        SendText(fd, "405 Method Not Allowed", "text/plain", "GET only\n");
+    }
+    else if (route == "/" || route.empty())
+    {
+        string body;
+        for (size_t s = 0; s < screens_.size(); s++)
+        {
+            body += "/screen/" + std::to_string(s) + "\n";
+            for (uint32_t v = 0; v < screens_[s]->NumViewers(); v++)
+                body += "/screen/" + std::to_string(s) + "/viewer/" + std::to_string(v) + "\n";
+        }
+        SendText(fd, "200 OK", "text/plain", body);
+    }
+    else if (!valid)
+    {
+        SendText(fd, "404 Not Found", "text/plain", "unknown stream\n");
+    }
+    else
+    {
+        shared_ptr<MjpegStream> stream = AcquireStream(screen_id, viewer_id);
+        uint64_t seq = 0;
+        if (snapshot)
+        {
+            auto jpeg = stream->WaitJpeg(seq, chrono::milliseconds(2000));
+            if (jpeg)
+            {
+                string header = "HTTP/1.0 200 OK\r\nContent-Type: image/jpeg\r\nContent-Length: " + std::to_string(jpeg->size()) +
+                                "\r\nConnection: close\r\n\r\n";
+                if (SendAll(fd, header.data(), header.size()))
+                    SendAll(fd, jpeg->data(), jpeg->size());
+            }
+            else
+            {
+                SendText(fd, "503 Service Unavailable", "text/plain", "no frame\n");
+            }
+        }
+        else
+        {
+            string header = "HTTP/1.0 200 OK\r\nContent-Type: multipart/x-mixed-replace; boundary=" MjpegBoundary
+                            "\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n";
+            bool ok = SendAll(fd, header.data(), header.size());
+            while (ok && running_)
+            {
+                auto jpeg = stream->WaitJpeg(seq, chrono::milliseconds(1000));
+                if (!jpeg)
+                    continue;
+                string part = "--" MjpegBoundary "\r\nContent-Type: image/jpeg\r\nContent-Length: " + std::to_string(jpeg->size()) + "\r\n\r\n";
+                ok = SendAll(fd, part.data(), part.size()) && SendAll(fd, jpeg->data(), jpeg->size()) && SendAll(fd, "\r\n", 2);
+            }
+        }
+        ReleaseStream(screen_id, viewer_id, stream);
+    }
+
+    lock_guard<mutex> lock(mutex_);
+    client_fds_.erase(std::remove(client_fds_.begin(), client_fds_.end(), fd), client_fds_.end());
+    close(fd);
+    active_clients_--;
+    clients_cv_.notify_all();
+}
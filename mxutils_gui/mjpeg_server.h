@@ -0,0 +1,93 @@
+#pragma once
+
+#include "gui_view.h"
+#include <atomic>
+#include <condition_variable>
+
+/**
+ * @brief MjpegStream encodes the frames of one viewer (or one screen mosaic) for HTTP clients.
+ *
+ * Frames are dropped immediately while nobody is connected. Otherwise the latest frame
+ * is handed to an encoder thread, encoded to JPEG once and shared by all clients; a
+ * slow client simply skips to the newest JPEG, so producers are never blocked.
+ */
+class MjpegStream : public FrameSink
+{
+public:
+    MjpegStream(int quality);
+    ~MjpegStream();
+
+    void OnFrame(const cv::Mat &rgb, chrono::steady_clock::time_point time) override;
+
+    void AddClient();
+
+    /**
+     * @brief Drops a client.
+     * @return The number of clients left.
+     */
+    int RemoveClient();
+
+    /**
+     * @brief Waits for a JPEG newer than `seq`.
+     * @param seq The sequence number last seen by the client, updated on return.
+     * @param timeout How long to wait.
+     * @return The encoded frame, or nullptr on timeout or when the stream is closed.
+     */
+    shared_ptr<const vector<uchar>> WaitJpeg(uint64_t &seq, chrono::milliseconds timeout);
+
+    void Close();
+
+private:
+    void Encoder();
+
+    int quality_;
+    atomic<int> clients_;
+    mutex mutex_;
+    condition_variable frame_cv_;
+    condition_variable jpeg_cv_;
+    cv::Mat latest_;
+    bool latest_pending_;
+    bool closed_;
+    shared_ptr<const vector<uchar>> jpeg_;
+    uint64_t jpeg_seq_;
+    std::thread encoder_;
+};
+
+/**
+ * @brief MjpegServer serves the viewers and mosaics of all screens over HTTP.
+ *
+ * Endpoints, with S the screen index and N the viewer index:
+ *   /                        list of the endpoints
+ *   /screen/S                MJPEG stream of the composited screen
+ *   /screen/S/viewer/N       MJPEG stream of one viewer
+ *   append .jpg to either    a single JPEG snapshot
+ */
+class MjpegServer
+{
+public:
+    MjpegServer(const vector<DisplayScreen *> &screens, int quality);
+    ~MjpegServer();
+
+    bool Start(const string &bind_address, uint16_t port);
+    void Stop();
+
+private:
+    void AcceptLoop();
+    void ServeClient(int fd);
+    // Stream of a viewer or mosaic with one more client, attached to it on first use
+    shared_ptr<MjpegStream> AcquireStream(int screen_id, int viewer_id);
+    // Drops the client and detaches the stream when it was the last one
+    void ReleaseStream(int screen_id, int viewer_id, const shared_ptr<MjpegStream> &stream);
+
+    vector<DisplayScreen *> screens_;
+    int quality_;
+    int listen_fd_;
+    atomic<bool> running_;
+    std::thread acceptor_;
+
+    mutex mutex_;
+    condition_variable clients_cv_;
+    map<pair<int, int>, shared_ptr<MjpegStream>> streams_;
+    vector<int> client_fds_;
+    int active_clients_;
+};
@@ -0,0 +1,149 @@
+#include "overlay_renderer.h"
+#include "plugin_dispatch.h"
+#include <cstdio>
+
+#define OverlayBoxThickness 2
+#define OverlayLabelPadding 3
+#define OverlayMaskAlpha 0.4
+
+/**
+ * @brief Blends a color into a row of RGB pixels by a per-pixel alpha.
+ *
+ * Branch-free so it vectorizes; an alpha of 0 leaves the pixel unchanged.
+ */
+MXUTILS_TARGET_CLONES static void BlendAlphaRow(uchar *p, const uchar *alpha, int cols, const int color[3])
+{
+    for (int col = 0; col < cols; col++, p += 3)
+    {
+        int a = alpha[col];
+        for (int ch = 0; ch < 3; ch++)
+            p[ch] = (uchar)((p[ch] * (255 - a) + color[ch] * a + 127) / 255);
+    }
+}
+
+/**
+ * @brief Blends a color into the pixels of a row that are set in the mask.
+ */
+MXUTILS_TARGET_CLONES static void BlendMaskRow(uchar *p, const uchar *mask, int cols, const int color[3], int alpha)
+{
+    for (int col = 0; col < cols; col++, p += 3)
+    {
+        int a = mask[col] ? alpha : 0;
+        for (int ch = 0; ch < 3; ch++)
+            p[ch] = (uchar)((p[ch] * (256 - a) + color[ch] * a) >> 8);
+    }
+}
+
+OverlayRenderer::OverlayRenderer()
+{
+    font_ = cv::FONT_HERSHEY_SIMPLEX;
+    font_scale_ = 0.5;
+    font_thickness_ = 1;
+
+    int baseline = 0;
+    cv::Size size = cv::getTextSize("Ag", font_, font_scale_, font_thickness_, &baseline);
+    ascent_ = size.height;
+    line_height_ = size.height + baseline + font_thickness_;
+}
+
+const OverlayRenderer::Glyph &OverlayRenderer::GetGlyph(unsigned char c)
+{
+    if (c >= glyphs_.size())
+        c = '?';
+    Glyph &glyph = glyphs_[c];
+    if (glyph.loaded)
+        return glyph;
+
+    string text(1, (char)c);
+    int baseline = 0;
+    cv::Size size = cv::getTextSize(text, font_, font_scale_, font_thickness_, &baseline);
+    glyph.advance = size.width;
+    glyph.alpha = cv::Mat::zeros(line_height_, std::max(1, size.width), CV_8UC1);
+    cv::putText(glyph.alpha, text, cv::Point(0, ascent_), font_, font_scale_, cv::Scalar(255), font_thickness_, cv::LINE_AA);
+    glyph.loaded = true;
+    return glyph;
+}
+
+int OverlayRenderer::TextWidth(const string &text)
+{
+    int width = 0;
+    for (char c : text)
+        width += GetGlyph((unsigned char)c).advance;
+    return width;
+}
+
+void OverlayRenderer::DrawText(cv::Mat &rgb, const string &text, cv::Point org, const cv::Scalar &color)
+{
+    int x = org.x;
+    const int rgb_color[3] = {(int)color[0], (int)color[1], (int)color[2]};
+    for (char c : text)
+    {
+        const Glyph &glyph = GetGlyph((unsigned char)c);
+        cv::Rect glyph_rect(x, org.y, glyph.alpha.cols, glyph.alpha.rows);
+        cv::Rect dst_rect = glyph_rect & cv::Rect(0, 0, rgb.cols, rgb.rows);
+        x += glyph.advance;
+        if (dst_rect.empty())
+            continue;
+
+        int gx = dst_rect.x - glyph_rect.x;
+        int gy = dst_rect.y - glyph_rect.y;
+        for (int r = 0; r < dst_rect.height; r++)
+        {
+            const uchar *a = glyph.alpha.ptr<uchar>(gy + r) + gx;
+            uchar *p = rgb.ptr<uchar>(dst_rect.y + r) + dst_rect.x * 3;
+            BlendAlphaRow(p, a, dst_rect.width, rgb_color);
+        }
+    }
+}
+
+void OverlayRenderer::DrawMask(cv::Mat &rgb, const cv::Mat &mask, const cv::Rect &box, const cv::Scalar &color)
+{
+    cv::Rect clipped = box & cv::Rect(0, 0, rgb.cols, rgb.rows);
+    if (clipped.empty() || mask.empty())
+        return;
+
+    cv::resize(mask, mask_scaled_, box.size(), 0, 0, cv::INTER_NEAREST);
+    cv::Mat mask_roi = mask_scaled_(cv::Rect(clipped.x - box.x, clipped.y - box.y, clipped.width, clipped.height));
+    cv::Mat roi = rgb(clipped);
+    int a = (int)(OverlayMaskAlpha * 256);
+    const int rgb_color[3] = {(int)color[0], (int)color[1], (int)color[2]};
+    for (int r = 0; r < roi.rows; r++)
+        BlendMaskRow(roi.ptr<uchar>(r), mask_roi.ptr<uchar>(r), roi.cols, rgb_color, a);
+}
+
+void OverlayRenderer::Draw(cv::Mat &rgb, const vector<OverlayItem> &items, double sx, double sy)
+{
+    char score_text[16];
+    for (const OverlayItem &item : items)
+    {
+        cv::Rect box((int)std::lround(item.box.x * sx), (int)std::lround(item.box.y * sy),
+                     (int)std::lround(item.box.width * sx), (int)std::lround(item.box.height * sy));
+        if (box.width <= 0 || box.height <= 0)
+            continue;
+
+        if (!item.mask.empty())
+            DrawMask(rgb, item.mask, box, item.color);
+
+        cv::rectangle(rgb, box, item.color, OverlayBoxThickness);
+
+        string text = item.label;
+        if (item.score >= 0)
+        {
+            snprintf(score_text, sizeof(score_text), "%s%.2f", text.empty() ? "" : " ", item.score);
+            text += score_text;
+        }
+        if (text.empty())
+            continue;
+
+        // Label sits on a filled tag above the box, or inside it at the top edge
+        int tag_w = TextWidth(text) + 2 * OverlayLabelPadding;
+        int tag_h = line_height_;
+        int tag_y = (box.y - tag_h >= 0) ? box.y - tag_h : box.y;
+        cv::Rect tag(box.x, tag_y, tag_w, tag_h);
+        cv::rectangle(rgb, tag & cv::Rect(0, 0, rgb.cols, rgb.rows), item.color, cv::FILLED);
+
+        double luma = 0.299 * item.color[0] + 0.587 * item.color[1] + 0.114 * item.color[2];
+        cv::Scalar text_color = (luma > 128) ? cv::Scalar(0, 0, 0) : cv::Scalar(255, 255, 255);
+        DrawText(rgb, text, cv::Point(box.x + OverlayLabelPadding, tag_y), text_color);
+    }
+}
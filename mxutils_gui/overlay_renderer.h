@@ -0,0 +1,47 @@
+#pragma once
+
+#include "gui_view.h"
+#include <array>
+
+/**
+ * @brief OverlayRenderer draws OverlayItems onto an RGB image at display resolution.
+ *
+ * Boxes and masks are scaled from source to display coordinates, so the cost only
+ * depends on the screen pixels covered. Text is composed from a per-renderer cache
+ * of anti-aliased glyph masks instead of rasterizing every label with cv::putText.
+ */
+class OverlayRenderer
+{
+public:
+    OverlayRenderer();
+
+    /**
+     * @brief Draws the items onto `rgb`.
+     * @param rgb The RGB888 display image to draw on.
+     * @param items The overlay items, in source frame coordinates.
+     * @param sx Horizontal scale from source to display coordinates.
+     * @param sy Vertical scale from source to display coordinates.
+     */
+    void Draw(cv::Mat &rgb, const vector<OverlayItem> &items, double sx, double sy);
+
+private:
+    struct Glyph
+    {
+        bool loaded = false;
+        cv::Mat alpha; // CV_8UC1, line_height_ rows
+        int advance = 0;
+    };
+
+    const Glyph &GetGlyph(unsigned char c);
+    int TextWidth(const string &text);
+    void DrawText(cv::Mat &rgb, const string &text, cv::Point org, const cv::Scalar &color);
+    void DrawMask(cv::Mat &rgb, const cv::Mat &mask, const cv::Rect &box, const cv::Scalar &color);
+
+    array<Glyph, 128> glyphs_;
+    int font_;
+    double font_scale_;
+    int font_thickness_;
+    int ascent_;
+    int line_height_;
+    cv::Mat mask_scaled_;
+};
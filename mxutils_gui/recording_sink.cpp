@@ -0,0 +1,264 @@
+#include "recording_sink.h"
+#include <algorithm>
+
+#define RecordingDrainBatch 4
+#define RawFrameMagic 0x4652584d // "MXRF"
+
+// Header in front of every frame of a raw segment, followed by height * width * channels RGB bytes
+struct RawFrameHeader
+{
+    uint32_t magic;
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels;
+    int64_t time_ns;
+};
+
+/**
+ * @brief Encoder threads shared by all recordings of the process.
+ *
+ * A recording is queued here whenever it has frames and no thread is draining it,
+ * so each recording is drained by at most one thread at a time.
+ */
+class RecordingPool
+{
+public:
+    static RecordingPool &Instance()
+    {
+        static RecordingPool pool;
+        return pool;
+    }
+
+    void Post(shared_ptr<RecordingSink> sink)
+    {
+        {
+            lock_guard<mutex> lock(mutex_);
+            ready_.push_back(std::move(sink));
+        }
+        cv_.notify_one();
+    }
+
+private:
+    RecordingPool() : stop_(false)
+    {
+        unsigned int num_threads = std::max(1u, std::min(4u, std::thread::hardware_concurrency() / 2));
+        for (unsigned int i = 0; i < num_threads; i++)
+            workers_.emplace_back(&RecordingPool::Worker, this);
+    }
+
+    ~RecordingPool()
+    {
+        {
+            lock_guard<mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (std::thread &t : workers_)
+            t.join();
+    }
+
+    void Worker()
+    {
+        while (true)
+        {
+            shared_ptr<RecordingSink> sink;
+            {
+                unique_lock<mutex> lock(mutex_);
+                cv_.wait(lock, [this]() { return stop_ || !ready_.empty(); });
+                if (ready_.empty())
+                    return;
+                sink = std::move(ready_.front());
+                ready_.pop_front();
+            }
+            // Round-robin between recordings so one slow encoder does not starve the others
+            if (sink->Drain(RecordingDrainBatch))
+                Post(std::move(sink));
+        }
+    }
+
+    mutex mutex_;
+    condition_variable cv_;
+    deque<shared_ptr<RecordingSink>> ready_;
+    vector<std::thread> workers_;
+    bool stop_;
+};
+
+RecordingSink::RecordingSink(const RecordingConfig &config) : config_(config)
+{
+    config_.queue_depth = std::max<size_t>(1, config_.queue_depth);
+    config_.segment_frames = std::max<size_t>(1, config_.segment_frames);
+    scheduled_ = false;
+    stopped_ = false;
+    enqueue_total_us_ = 0;
+    segment_ = nullptr;
+    segment_idx_ = 0;
+    segment_count_ = 0;
+}
+
+RecordingSink::~RecordingSink()
+{
+    Stop();
+}
+
+void RecordingSink::OnFrame(const cv::Mat &rgb, chrono::steady_clock::time_point time)
+{
+    auto start = chrono::steady_clock::now();
+    Entry entry;
+    {
+        unique_lock<mutex> lock(mutex_);
+        if (stopped_)
+            return;
+        if (queue_.size() >= config_.queue_depth)
+        {
+            switch (config_.drop_policy)
+            {
+            case RecordingDropPolicy::DropNewest:
+                stats_.frames_dropped++;
+                return;
+            case RecordingDropPolicy::DropOldest:
+                free_.push_back(queue_.front().frame);
+                queue_.pop_front();
+                stats_.frames_dropped++;
+                break;
+            case RecordingDropPolicy::Block:
+                space_cv_.wait(lock, [this]() { return stopped_ || queue_.size() < config_.queue_depth; });
+                if (stopped_)
+                    return;
+                break;
+            }
+        }
+        if (!free_.empty())
+        {
+            entry.frame = free_.back();
+            free_.pop_back();
+        }
+    }
+
+    // The buffer is exclusively ours here, copyTo only reallocates when the size changed
+    rgb.copyTo(entry.frame);
+    entry.time = time;
+
+    bool post;
+    {
+        lock_guard<mutex> lock(mutex_);
+        // Stop may have run during the copy, the output is closed by now
+        if (stopped_)
+        {
+            free_.push_back(entry.frame);
+            return;
+        }
+        queue_.push_back(std::move(entry));
+        stats_.frames_enqueued++;
+        post = !scheduled_;
+        scheduled_ = true;
+
+        double us = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+        enqueue_total_us_ += us;
+        stats_.enqueue_avg_us = enqueue_total_us_ / stats_.frames_enqueued;
+        stats_.enqueue_max_us = std::max(stats_.enqueue_max_us, us);
+    }
+    if (post)
+        RecordingPool::Instance().Post(shared_from_this());
+}
+
+bool RecordingSink::Drain(size_t max_frames)
+{
+    for (size_t n = 0; n < max_frames; n++)
+    {
+        Entry entry;
+        {
+            lock_guard<mutex> lock(mutex_);
+            if (queue_.empty())
+            {
+                scheduled_ = false;
+                idle_cv_.notify_all();
+                return false;
+            }
+            entry = std::move(queue_.front());
+            queue_.pop_front();
+        }
+        space_cv_.notify_one();
+
+        Write(entry);
+
+        lock_guard<mutex> lock(mutex_);
+        free_.push_back(entry.frame);
+        stats_.frames_written++;
+    }
+
+    lock_guard<mutex> lock(mutex_);
+    if (queue_.empty())
+    {
+        scheduled_ = false;
+        idle_cv_.notify_all();
+        return false;
+    }
+    return true;
+}
+
+void RecordingSink::OpenSegment()
+{
+    if (segment_)
+        fclose(segment_);
+    char name[32];
+    snprintf(name, sizeof(name), "_%05zu.raw", segment_idx_++);
+    segment_ = fopen((config_.path + name).c_str(), "wb");
+    segment_count_ = 0;
+}
+
+void RecordingSink::Write(const Entry &entry)
+{
+    const cv::Mat &frame = entry.frame;
+    if (config_.raw)
+    {
+        if (!segment_ || segment_count_ >= config_.segment_frames)
+            OpenSegment();
+        if (!segment_)
+            return;
+        RawFrameHeader header = {RawFrameMagic, (uint32_t)frame.cols, (uint32_t)frame.rows, (uint32_t)frame.channels(),
+                                 chrono::duration_cast<chrono::nanoseconds>(entry.time.time_since_epoch()).count()};
+        fwrite(&header, sizeof(header), 1, segment_);
+        for (int r = 0; r < frame.rows; r++)
+            fwrite(frame.ptr(r), frame.elemSize(), frame.cols, segment_);
+        segment_count_++;
+        return;
+    }
+
+    // The container has a fixed size, later frames (e.g. after a relayout) are scaled to it
+    if (!writer_.isOpened())
+    {
+        writer_size_ = frame.size();
+        writer_.open(config_.path, config_.fourcc, config_.fps, writer_size_, true);
+        if (!writer_.isOpened())
+            return;
+    }
+    cv::cvtColor(frame, bgr_, cv::COLOR_RGB2BGR);
+    if (bgr_.size() != writer_size_)
+        cv::resize(bgr_, bgr_, writer_size_);
+    writer_.write(bgr_);
+}
+
+void RecordingSink::Stop()
+{
+    {
+        unique_lock<mutex> lock(mutex_);
+        if (stopped_)
+            return;
+        stopped_ = true;
+        space_cv_.notify_all();
+        idle_cv_.wait(lock, [this]() { return !scheduled_; });
+    }
+    if (writer_.isOpened())
+        writer_.release();
+    if (segment_)
+    {
+        fclose(segment_);
+        segment_ = nullptr;
+    }
+}
+
+RecordingStats RecordingSink::GetStats()
+{
+    lock_guard<mutex> lock(mutex_);
+    return stats_;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "gui_view.h"
+#include <condition_variable>
+#include <deque>
+#include <cstdio>
+
+/**
+ * @brief RecordingSink archives displayed frames without stalling the display path.
+ *
+ * OnFrame copies the frame into a recycled buffer of a bounded queue; a process-wide
+ * pool of encoder threads drains the queues of all recordings, one frame at a time
+ * per recording so the output stays in order. The pool holds a reference while a
+ * recording is queued, so the sink must be owned by a shared_ptr.
+ */
+class RecordingSink : public FrameSink, public enable_shared_from_this<RecordingSink>
+{
+public:
+    RecordingSink(const RecordingConfig &config);
+    ~RecordingSink();
+
+    void OnFrame(const cv::Mat &rgb, chrono::steady_clock::time_point time) override;
+
+    /**
+     * @brief Waits for the queued frames to be written and closes the output.
+     */
+    void Stop();
+
+    RecordingStats GetStats();
+
+private:
+    friend class RecordingPool;
+
+    struct Entry
+    {
+        cv::Mat frame;
+        chrono::steady_clock::time_point time;
+    };
+
+    // Called by the encoder pool, returns true while more frames are queued
+    bool Drain(size_t max_frames);
+    void Write(const Entry &entry);
+    void OpenSegment();
+
+    RecordingConfig config_;
+    mutex mutex_;
+    condition_variable space_cv_;
+    condition_variable idle_cv_;
+    deque<Entry> queue_;
+    vector<cv::Mat> free_;
+    bool scheduled_;
+    bool stopped_;
+    RecordingStats stats_;
+    double enqueue_total_us_;
+
+    // Owned by the draining encoder thread
+    cv::VideoWriter writer_;
+    cv::Size writer_size_;
+    cv::Mat bgr_;
+    FILE *segment_;
+    size_t segment_idx_;
+    size_t segment_count_;
+};
@@ -0,0 +1,64 @@
+#include "render_worker.h"
+
+RenderWorker::RenderWorker(DisplayScreen *screen) : screen_(screen)
+{
+    stop_ = false;
+    thread_ = std::thread(&RenderWorker::Run, this);
+}
+
+RenderWorker::~RenderWorker()
+{
+    Stop();
+}
+
+void RenderWorker::Post(const vector<FrameViewer *> &viewers)
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (stop_)
+            return;
+        // A viewer is only marked dirty again once its pending frame was taken, no duplicates here
+        queued_.insert(queued_.end(), viewers.begin(), viewers.end());
+    }
+    cv_.notify_one();
+}
+
+void RenderWorker::Stop()
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (stop_)
+            return;
+        stop_ = true;
+        queued_.clear();
+    }
+    cv_.notify_one();
+    thread_.join();
+}
+
+void RenderWorker::Run()
+{
+    while (true)
+    {
+        {
+            unique_lock<mutex> lock(mutex_);
+            cv_.wait(lock, [this]() { return stop_ || !queued_.empty(); });
+            if (stop_)
+                return;
+            batch_.swap(queued_);
+        }
+
+        bool rendered = false;
+        for (FrameViewer *viewer : batch_)
+        {
+            if (viewer->Render())
+            {
+                screen_->QueuePresent(viewer);
+                rendered = true;
+            }
+        }
+        if (rendered)
+            screen_->FlushMosaic();
+        batch_.clear();
+    }
+}
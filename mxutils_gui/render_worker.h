@@ -0,0 +1,41 @@
+#pragma once
+
+#include "gui_view.h"
+#include <condition_variable>
+
+/**
+ * @brief RenderWorker renders the frames of one screen off the GUI thread.
+ *
+ * The RepaintScheduler hands over the viewers holding new frames once per refresh. The
+ * worker converts, scales, draws overlays, feeds sinks and composes the mosaic, then
+ * the screen presents the finished images on the GUI thread. Every screen has its own
+ * worker, so a busy monitor does not slow down the others.
+ */
+class RenderWorker
+{
+public:
+    RenderWorker(DisplayScreen *screen);
+    ~RenderWorker();
+
+    /**
+     * @brief Queues viewers for rendering. Thread-safe, never blocks on rendering.
+     * @param viewers The viewers holding a new pending frame.
+     */
+    void Post(const vector<FrameViewer *> &viewers);
+
+    /**
+     * @brief Finishes the batch being rendered and joins the thread.
+     */
+    void Stop();
+
+private:
+    void Run();
+
+    DisplayScreen *screen_;
+    mutex mutex_;
+    condition_variable cv_;
+    vector<FrameViewer *> queued_;
+    vector<FrameViewer *> batch_;
+    bool stop_;
+    std::thread thread_;
+};